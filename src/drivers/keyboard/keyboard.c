@@ -2,6 +2,7 @@
 #include "keyboard_mapping.h"
 #include "../../interrupts/isr.h"
 #include "../../screen/monitor.h"
+#include "../../process/wait.h"
 
 /**
  * A keyboard interfaces with a Keyboard Controller to specify when and what key is pressed/released.
@@ -21,6 +22,15 @@ static uint8 keyboard_flags = 0;
 // Flag which identifies control
 #define CTRL 4 
 
+// keys typed but not read by keyboard_getchar yet, further keys are dropped while it is full
+#define KEYBOARD_BUFFER_SIZE 64
+static char key_buffer[KEYBOARD_BUFFER_SIZE];
+static size_t key_head = 0;
+static size_t key_count = 0;
+
+// tasks blocked in keyboard_getchar
+static wait_queue_t key_readers;
+
 
 static void update_keyboard_flags_on_press(uint8 scan_code) {
     if (scan_code == KEY_LEFT_SHIFT || scan_code == KEY_RIGHT_SHIFT) {
@@ -74,9 +84,33 @@ static void keyboard_handler(registers_t regs) {
         update_keyboard_flags_on_press(scan_code);
         char key_pressed = get_char_for_scan_code(scan_code);
         monitor_put(key_pressed);
+
+        // modifiers and unmapped keys have no character to hand out
+        if (key_pressed != (char)-1 && key_pressed != 0 && key_count < KEYBOARD_BUFFER_SIZE) {
+            key_buffer[(key_head + key_count) % KEYBOARD_BUFFER_SIZE] = key_pressed;
+            key_count++;
+            // whoever waits for input gets to run right away, ahead of tasks that are busy computing
+            wake_up_interactive(&key_readers);
+        }
     }
 }
 
+char keyboard_getchar() {
+    // the buffer is filled from the interrupt handler
+    size_t eflags = irq_save();
+
+    while (key_count == 0)
+        sleep_on(&key_readers);
+
+    char c = key_buffer[key_head];
+    key_head = (key_head + 1) % KEYBOARD_BUFFER_SIZE;
+    key_count--;
+
+    irq_restore(eflags);
+    return c;
+}
+
 void install_keyboard_driver() {
+    wait_queue_init(&key_readers);
     register_interrupt_handler(IRQ1, &keyboard_handler);
 }
\ No newline at end of file
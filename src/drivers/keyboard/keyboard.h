@@ -5,4 +5,10 @@
 
 void install_keyboard_driver();
 
+/**
+ * Returns the next key typed, blocking until there is one (needs tasking)
+ * The task is woken at SCHED_INTERACTIVE_PRIORITY, so typing stays responsive while CPU bound tasks run
+ */
+char keyboard_getchar();
+
 #endif
\ No newline at end of file
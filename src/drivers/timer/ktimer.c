@@ -0,0 +1,184 @@
+#include "ktimer.h"
+#include "timer.h"
+#include "../../tools.h"
+
+#define SLOT_MASK (KTIMER_SLOTS - 1)
+
+static ktimer_t *wheel[KTIMER_LEVELS][KTIMER_SLOTS];
+
+// bit s of pending[level] is set while wheel[level][s] has a timer in it
+static uint64 pending[KTIMER_LEVELS];
+
+// next tick to run, every timer before it has fired
+static size_t wheel_time = 0;
+
+// number of pending timers
+static size_t timer_count = 0;
+
+// index of the lowest set bit, value must not be 0
+static uint32 bit_scan(uint32 value) {
+    uint32 index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// distance from slot from to the first non-empty slot at or after it on the given level (wrapping around), KTIMER_SLOTS if the level is empty
+static uint32 next_pending(uint32 level, uint32 from) {
+    uint64 bits = pending[level];
+    if (!bits)
+        return KTIMER_SLOTS;
+
+    if (from)
+        bits = (bits >> from) | (bits << (KTIMER_SLOTS - from));
+    if ((uint32)bits)
+        return bit_scan((uint32)bits);
+    return 32 + bit_scan((uint32)(bits >> 32));
+}
+
+static void slot_insert(ktimer_t *timer, uint32 level, uint32 index) {
+    ktimer_t **slot = &wheel[level][index];
+    timer->prev = 0;
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot = timer;
+    timer->slot = slot;
+    pending[level] |= (uint64)1 << index;
+}
+
+static void slot_remove(ktimer_t *timer) {
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (!*timer->slot) {
+        uint32 flat = timer->slot - &wheel[0][0];
+        pending[flat / KTIMER_SLOTS] &= ~((uint64)1 << (flat % KTIMER_SLOTS));
+    }
+    timer->slot = 0;
+}
+
+// puts a timer into the lowest level whose range reaches its expiry
+static void wheel_insert(ktimer_t *timer) {
+    size_t expires = timer->expires;
+
+    // already due, runs on the next tick
+    if ((int)(expires - wheel_time) < 0)
+        expires = wheel_time;
+
+    size_t delta = expires - wheel_time;
+    uint32 level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= ((size_t)1 << (KTIMER_SLOT_BITS * (level + 1))))
+        level++;
+
+    // too far away for the wheel, parked in the furthest top level slot and cascaded down until it fits
+    size_t reach = (size_t)1 << (KTIMER_SLOT_BITS * KTIMER_LEVELS);
+    if (delta >= reach)
+        expires = wheel_time + reach - 1;
+
+    slot_insert(timer, level, (expires >> (KTIMER_SLOT_BITS * level)) & SLOT_MASK);
+}
+
+// moves every timer of the given slot down to the level it now belongs in
+static void cascade(uint32 level, uint32 index) {
+    ktimer_t *timer = wheel[level][index];
+    wheel[level][index] = 0;
+    pending[level] &= ~((uint64)1 << index);
+
+    while (timer) {
+        ktimer_t *next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+}
+
+void ktimer_init(ktimer_t *timer, void (*fn)(void *arg), void *arg) {
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->next = timer->prev = 0;
+    timer->slot = 0;
+}
+
+void ktimer_add(ktimer_t *timer, size_t ticks) {
+    size_t eflags = irq_save();
+
+    if (timer->slot)
+        slot_remove(timer);
+    else
+        timer_count++;
+
+    timer->expires = tick + (ticks ? ticks : 1);
+    wheel_insert(timer);
+
+    // a tickless timer may be armed for later than this
+    timer_wake_by(timer->expires);
+
+    irq_restore(eflags);
+}
+
+int ktimer_cancel(ktimer_t *timer) {
+    size_t eflags = irq_save();
+
+    int was_pending = timer->slot != 0;
+    if (was_pending) {
+        slot_remove(timer);
+        timer_count--;
+    }
+
+    irq_restore(eflags);
+    return was_pending;
+}
+
+void ktimer_run(size_t now) {
+    while ((int)(now - wheel_time) >= 0) {
+        uint32 index = wheel_time & SLOT_MASK;
+
+        // every KTIMER_SLOTS ticks the next slot of the level above moves down, and so on up the levels
+        uint32 level = 1;
+        while (!index && level < KTIMER_LEVELS) {
+            index = (wheel_time >> (KTIMER_SLOT_BITS * level)) & SLOT_MASK;
+            cascade(level, index);
+            level++;
+        }
+
+        ktimer_t **slot = &wheel[0][wheel_time & SLOT_MASK];
+        // moved on first, so a callback adding a timer that is due right away gets it run on the next tick instead of in this slot
+        wheel_time++;
+
+        while (*slot) {
+            ktimer_t *timer = *slot;
+            slot_remove(timer);
+            timer_count--;
+            timer->fn(timer->arg);
+        }
+    }
+}
+
+size_t ktimer_next_expiry() {
+    if (!timer_count)
+        return 0;
+
+    // level 0 slots hold exactly one tick each
+    uint32 offset = next_pending(0, wheel_time & SLOT_MASK);
+    size_t next = offset < KTIMER_SLOTS ? wheel_time + offset : 0;
+
+    // higher levels only need the tick their next non-empty slot gets cascaded at
+    // the slot of the current index was cascaded already, it comes round again after a full turn of the level
+    uint32 level;
+    for (level = 1; level < KTIMER_LEVELS; level++) {
+        uint32 shift = KTIMER_SLOT_BITS * level;
+        uint32 current = (wheel_time >> shift) & SLOT_MASK;
+        offset = next_pending(level, (current + 1) & SLOT_MASK) + 1;
+        if (offset > KTIMER_SLOTS)
+            continue;
+
+        size_t at = ((wheel_time >> shift) + offset) << shift;
+        if (!next || (int)(at - next) < 0)
+            next = at;
+    }
+
+    return next;
+}
@@ -0,0 +1,45 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include "../../tools.h"
+
+/**
+ * Kernel timers on a hierarchical timing wheel
+ * Level 0 has a slot for each of the next 64 ticks, each slot of level n covers 64^n ticks. A timer goes into the
+ * lowest level that reaches its expiry, so adding and cancelling are a list insert/remove and nothing is ever sorted.
+ * Every tick runs the level 0 slot for that tick, and every 64 ticks the next slot of the level above is cascaded:
+ * its timers are moved down to where they now belong. Each timer is moved at most once per level.
+ *
+ * Timers further away than the wheel reaches (64^4 ticks) are parked in the top level and cascaded until they fit.
+ * Callbacks run from the timer interrupt with interrupts off, they must not block.
+ */
+
+#define KTIMER_LEVELS     4
+#define KTIMER_SLOT_BITS  6
+#define KTIMER_SLOTS      (1 << KTIMER_SLOT_BITS)
+
+typedef struct ktimer {
+    size_t expires;             // tick the timer fires at
+    void (*fn)(void *arg);      // called when it fires
+    void *arg;
+    struct ktimer *next;        // next timer in its wheel slot
+    struct ktimer *prev;        // previous timer in its wheel slot
+    struct ktimer **slot;       // wheel slot the timer is in, 0 while it is not pending
+} ktimer_t;
+
+// prepares a timer that calls fn(arg) when it fires
+void ktimer_init(ktimer_t *timer, void (*fn)(void *arg), void *arg);
+
+// fires the timer ticks ticks from now (at least 1), a pending timer is moved to the new expiry
+void ktimer_add(ktimer_t *timer, size_t ticks);
+
+// stops a pending timer, returns 1 if it was pending and 0 if it already fired (or was never added)
+int ktimer_cancel(ktimer_t *timer);
+
+// called by the timer interrupt, runs every timer that expired up to and including tick now
+void ktimer_run(size_t now);
+
+// earliest tick a timer may need to run at (possibly just a cascade), 0 if no timer is pending
+size_t ktimer_next_expiry();
+
+#endif
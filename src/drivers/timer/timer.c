@@ -1,36 +1,168 @@
 #include "timer.h"
+#include "ktimer.h"
 #include "../../interrupts/isr.h"
 #include "../../screen/monitor.h"
 #include "../../process/task.h"
 #include "../../tools.h"
 
+// PIT ports, channel 0 is the one wired to IRQ0
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+
+// channel 0, low byte then high byte, binary counting
+// mode 3 (square wave) reloads the divisor every time it hits 0, mode 0 counts down once and stops interrupting
+#define PIT_PERIODIC 0x36
+#define PIT_ONE_SHOT 0x30
+// channel 0 latch, freezes the current count until it has been read
+#define PIT_LATCH    0x00
+
 size_t tick = 0;
 
-static void timer_callback(registers_t regs) {
-    tick++;
-    switch_task();
+static uint8 mode = TIMER_PERIODIC;
+
+// PIT cycles per tick
+static size_t divisor;
+
+// tickless mode: ticks until the armed one-shot fires, and the PIT cycles of the current tick already spent
+// by deadlines that were replaced before they fired
+static size_t armed_ticks = 0;
+static size_t partial_cycles = 0;
+
+// tickless mode: tick the scheduler wants to be interrupted at, 0 for none
+static size_t sched_deadline = 0;
+
+static void pit_program(uint8 command, size_t count) {
+    outb(PIT_COMMAND, command);
+
+    // must be sent as 2 separate bytes, not one 16 bit value. 
+    uint8 l = (uint8)(count & 0xFF);
+    uint8 h = (uint8)((count>>8) & 0xFF);
+
+    outb(PIT_CHANNEL0, l);
+    outb(PIT_CHANNEL0, h);
+}
+
+// PIT cycles left before channel 0 reaches 0
+static size_t pit_remaining() {
+    outb(PIT_COMMAND, PIT_LATCH);
+    uint8 l = inb(PIT_CHANNEL0);
+    uint8 h = inb(PIT_CHANNEL0);
+    return l | (h << 8);
+}
+
+static void timer_callback(registers_t *regs) {
+    // a one-shot covers all the ticks it was armed for
+    size_t elapsed = 1;
+    if (mode == TIMER_TICKLESS) {
+        elapsed = armed_ticks;
+        armed_ticks = 0;
+    }
+    tick += elapsed;
+
+    // wakes sleeping tasks first so the scheduler below already sees them
+    ktimer_run(tick);
+
+    // asks for a switch once the timeslice is used up, irq_handler makes it on the way out
+    // otherwise re-arms the timer for the running task (a switch re-arms it for the next one)
+    task_tick(elapsed);
+
+    // nobody set a deadline (e.g. tasking is not on yet), keep the clock going
+    if (mode == TIMER_TICKLESS && !armed_ticks)
+        timer_set_deadline(0);
     // monitor_write("Tick ");
     // monitor_write_dec(tick);
     // monitor_write("\n");
 }
 
+void set_timer_mode(uint8 timer_mode) {
+    mode = timer_mode;
+}
+
 void init_timer(size_t frequency) {
     register_interrupt_handler(IRQ0, &timer_callback);
 
     // The value we send to the PIT is the value to divide it's input clock
     // (1193180 Hz) by, to get our required frequency. Important to note is
     // that the divisor must be small enough to fit into 16-bits.
-    size_t divisor = 1193180 / frequency;
+    // below about 19 Hz it does not, the timer then runs at the slowest rate the PIT can count (about 18.2 Hz)
+    divisor = PIT_FREQUENCY / frequency;
+    if (divisor > 0xFFFF)
+        divisor = 0xFFFF;
+    if (divisor == 0)
+        divisor = 1;
 
+    if (mode == TIMER_TICKLESS) {
+        timer_set_deadline(0);
+        return;
+    }
+
+    // 0x43 is the PIT command port
     // 0x36 sets clock to repeating mode (refresh after divisor hits 0)
     // it also says we want to set the divisor value
-    // TODO: not sure what 0x43 is for so look into that
-    outb(0x43, 0x36);
+    pit_program(PIT_PERIODIC, divisor);
+}
 
-    // must be sent as 2 separate bytes, not one 16 bit value. 
-    uint8 l = (uint8)(divisor & 0xFF);
-    uint8 h = (uint8)((divisor>>8) & 0xFF);
+// ticks from now until absolute tick at, at least 1
+static size_t ticks_until(size_t at) {
+    return (int)(at - tick) > 0 ? at - tick : 1;
+}
+
+/**
+ * Tickless mode, interrupts off
+ * Re-arms the one-shot for whichever comes first, the scheduler's deadline or the next kernel timer
+ */
+static void rearm() {
+    // the deadline being replaced has not fired yet, account for the part of it that has passed
+    // if it already ran out the count has wrapped past armed_ticks*divisor, and its interrupt is pending:
+    // that interrupt then arrives early for the new deadline, which only cuts one timeslice short
+    if (armed_ticks) {
+        size_t armed = armed_ticks * divisor;
+        size_t remaining = pit_remaining();
+        if (remaining <= armed) {
+            partial_cycles += armed - remaining;
+            tick += partial_cycles / divisor;
+            partial_cycles %= divisor;
+        }
+    }
+
+    size_t ticks = sched_deadline ? ticks_until(sched_deadline) : 0;
+
+    size_t expiry = ktimer_next_expiry();
+    if (expiry && (!ticks || ticks_until(expiry) < ticks))
+        ticks = ticks_until(expiry);
+
+    // a one-shot covers at least one tick, otherwise the PIT would be armed for 0 cycles and tick would never move
+    size_t max_ticks = 0xFFFF / divisor;
+    if (!max_ticks)
+        max_ticks = 1;
+    if (!ticks || ticks > max_ticks)
+        ticks = max_ticks;
+
+    armed_ticks = ticks;
+    pit_program(PIT_ONE_SHOT, ticks * divisor);
+}
+
+void timer_set_deadline(size_t ticks) {
+    if (mode != TIMER_TICKLESS)
+        return;
+
+    size_t eflags = irq_save();
+
+    sched_deadline = ticks ? tick + ticks : 0;
+    rearm();
+
+    irq_restore(eflags);
+}
+
+void timer_wake_by(size_t at) {
+    if (mode != TIMER_TICKLESS)
+        return;
+
+    size_t eflags = irq_save();
+
+    // nothing to do if the armed one-shot fires in time anyway
+    if (!armed_ticks || ticks_until(at) < armed_ticks)
+        rearm();
 
-    outb(0x40, l);
-    outb(0x40, h);
+    irq_restore(eflags);
 }
\ No newline at end of file
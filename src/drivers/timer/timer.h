@@ -10,6 +10,34 @@
  * This is also how a system clock is implemented
 */
 
+// interrupts on every tick
+#define TIMER_PERIODIC 0
+// only interrupts when something is due, the PIT is programmed one-shot for the next deadline (see timer_set_deadline)
+#define TIMER_TICKLESS 1
+
+// PIT input clock in Hz
+#define PIT_FREQUENCY 1193180
+
+// timer ticks since init_timer, in units of 1/frequency seconds
+extern size_t tick;
+
+// selects TIMER_PERIODIC (default) or TIMER_TICKLESS, must be called before init_timer
+void set_timer_mode(uint8 mode);
+
+// frequency in Hz, anything below what a 16 bit divisor can produce (about 18.2 Hz) runs at that slowest rate
 void init_timer(size_t frequency);
 
+/**
+ * Tickless mode only, does nothing in periodic mode
+ * Arranges for the next timer interrupt to arrive ticks ticks from now, replacing the previous deadline.
+ * 0 means there is no deadline: the PIT is still armed for the longest one-shot it can count (65535 PIT cycles,
+ * about 55ms) so tick keeps advancing, but an idle CPU is woken up far less often than with a periodic timer.
+ * Deadlines further away than that are cut short in the same way and the handler simply re-arms.
+ * Pending kernel timers (see ktimer.h) are taken into account as well, the PIT is armed for whichever comes first.
+ */
+void timer_set_deadline(size_t ticks);
+
+// tickless mode only, makes sure the timer interrupts no later than tick at (used by ktimer_add)
+void timer_wake_by(size_t at);
+
 #endif
\ No newline at end of file
@@ -11,6 +11,9 @@ int nroot_nodes;
 
 struct dirent dirent;
 
+// fs_node_t objects for the root and /dev directories
+static kmem_cache_t *fs_node_cache;
+
 static size_t initrd_read(fs_node_t *node, size_t offset, size_t size, uint8 *buffer) {
     initrd_file_header_t header = file_headers[node->inode];
     if (offset > header.length)
@@ -56,7 +59,9 @@ fs_node_t *initialise_initrd(size_t location) {
     initrd_header = (initrd_header_t *)location;
     file_headers = (initrd_file_header_t *) (location+sizeof(initrd_header_t));
 
-    initrd_root = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    fs_node_cache = kmem_cache_create("fs_node", sizeof(fs_node_t), 0, 0);
+
+    initrd_root = (fs_node_t*)kmem_cache_alloc(fs_node_cache);
     strcpy(initrd_root->name, "J");
     initrd_root->mask = initrd_root->uid = initrd_root->gid = initrd_root->inode = initrd_root->length = 0;
     initrd_root->flags = FS_DIRECTORY;
@@ -69,7 +74,7 @@ fs_node_t *initialise_initrd(size_t location) {
     initrd_root->ptr = 0;
     initrd_root->impl = 0;
 
-    initrd_dev = (fs_node_t*)kmalloc(sizeof(fs_node_t));
+    initrd_dev = (fs_node_t*)kmem_cache_alloc(fs_node_cache);
     strcpy(initrd_dev->name, "dev");
     initrd_dev->mask = initrd_dev->uid = initrd_dev->gid = initrd_dev->inode = initrd_dev->length = 0;
     initrd_dev->flags = FS_DIRECTORY;
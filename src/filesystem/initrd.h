@@ -4,6 +4,7 @@
 
 #include "../tools.h"
 #include "../memory/kheap.h"
+#include "../memory/slab.h"
 #include "fs.h"
 
 /**
@@ -2,6 +2,8 @@
 #include "../tools.h"
 #include "isr.h"
 #include "../screen/monitor.h"
+#include "../process/preempt.h"
+#include "../utils/irq_latency.h"
 
 isr_t interrupt_handlers[256];
 
@@ -34,4 +36,10 @@ void irq_handler(registers_t *regs) {
         handler(regs);
     }
 
+    // the handler may have used up the timeslice or woken a more important task
+    preempt_irq_return();
+
+    // the iret turns interrupts back on, possibly for a task that was switched to with a window still open
+    if (irq_latency_tracking)
+        irq_latency_end();
 }
\ No newline at end of file
@@ -3,22 +3,32 @@
 #include "drivers/timer/timer.h"
 #include "filesystem/fs.h"
 #include "filesystem/initrd.h"
+#include "memory/kheap.h"
+#include "memory/memmap.h"
 #include "memory/paging.h"
+#include "memory/tlb.h"
+#include "process/preempt.h"
 #include "process/task.h"
 #include "multiboot.h"
 #include "screen/monitor.h"
 #include "utils/asm.h"
+#include "utils/irq_latency.h"
 #include "tools.h"
 
 extern size_t placement_address; //fs start
+extern page_directory_t *current_directory;
+extern volatile task_t *current_task;
 size_t initial_esp;
 
 // helpers defined below
 size_t create_filesystem(struct multiboot *mboot_ptr);
+void parse_boot_options(struct multiboot *mboot_ptr);
 
 // test helpers
 void force_page_fault();
 void test_heap();
+void benchmark_switch_cost();
+void benchmark_context_switch();
 void print_filesystem_contents();
 
 
@@ -29,12 +39,18 @@ int kernel_main(struct multiboot *mboot_ptr, size_t initial_stack) {
 	init_descriptor_tables();
 	monitor_clear();
 
-    // start PIT - number specified equals interrupts per second
-	// init_timer(1);
+    // find out which physical memory is usable before anything gets allocated
+    memmap_init(mboot_ptr);
 
     // reserve beginning of memory for filesystem befor enabling paging
     size_t initrd_location = create_filesystem(mboot_ptr);
 
+    // kernel command line options from the GRUB kernel line in menu.lst
+    parse_boot_options(mboot_ptr);
+
+    // start PIT - number specified equals interrupts per second
+	// init_timer(100);
+
     // comment out initialise_paging if testing heap
     // test_heap();
     initialise_paging();
@@ -48,6 +64,12 @@ int kernel_main(struct multiboot *mboot_ptr, size_t initial_stack) {
     // register handler for IRQ1
     install_keyboard_driver(); 
 
+    // compares the cost of a CR3 reload with and without global kernel pages
+    // benchmark_switch_cost();
+
+    // average cycles for one switch_to between two tasks sharing a directory
+    // benchmark_context_switch();
+
     // enables interrupts
 	act_itr();
 
@@ -71,7 +93,15 @@ int kernel_main(struct multiboot *mboot_ptr, size_t initial_stack) {
 
     print_filesystem_contents();
 
-    return 0;
+    if (irq_latency_tracking)
+        irq_latency_print_stats();
+
+    // nothing left to do: with tasking on the kernel task leaves the run queue for good and the idle task takes over
+    if (current_task)
+        exit(0);
+
+    // otherwise idle in place: zero free frames for the page fault path until the pool is full, then sleep until an interrupt
+    idle();
 }
 
 size_t create_filesystem(struct multiboot *mboot_ptr) {
@@ -87,17 +117,44 @@ size_t create_filesystem(struct multiboot *mboot_ptr) {
 }
 
 
+/**
+ * Options are passed by appending them to the kernel line in iso/boot/grub/menu.lst, e.g.
+ *   kernel /boot/kernel kheap=ordered
+ * must run before initialise_paging since that is when the kernel heap is created, and before init_timer
+ */
+void parse_boot_options(struct multiboot *mboot_ptr) {
+    if (!(mboot_ptr->flags & MULTIBOOT_FLAG_CMDLINE))
+        return;
+
+    char *cmdline = (char*)mboot_ptr->cmdline;
+
+    // kheap=ordered switches back to the original ordered array heap to compare against TLSF
+    if (strstr(cmdline, "kheap=ordered"))
+        set_heap_backend(HEAP_BACKEND_ORDERED);
+
+    // irqtrace records the longest stretches with interrupts off and where they started, printed once booting is done
+    if (strstr(cmdline, "irqtrace"))
+        irq_latency_enable();
+
+    // timer=tickless only programs the PIT for the next deadline instead of interrupting on every tick
+    if (strstr(cmdline, "timer=tickless"))
+        set_timer_mode(TIMER_TICKLESS);
+}
+
 // TEST HELPERS
 
 void run_tests() {
     test_heap();
     force_page_fault();
+    benchmark_switch_cost();
+    benchmark_context_switch();
 }
 
 void print_filesystem_contents() {
-    // not reentrant so make sure we are not interrupted
+    // the filesystem is not reentrant so make sure no other task gets in, interrupts can stay on
+    // the monitor protects itself against the keyboard echoing keys from its interrupt
 
-    deact_itr();
+    preempt_disable();
 
     if (!fs_root) {
         monitor_write("\nNo filesystem found\n");
@@ -126,7 +183,92 @@ void print_filesystem_contents() {
     }
     monitor_write("\n");
 
-    act_itr();
+    preempt_enable();
+}
+
+#define SWITCH_BENCH_ROUNDS 1000
+#define SWITCH_BENCH_PAGES  64
+
+// average cycles for a CR3 reload followed by kernel work that touches SWITCH_BENCH_PAGES pages
+static uint32 time_switches() {
+    size_t cr3 = page_directory_physical(current_directory);
+    uint64 start = rdtsc();
+    int r, p;
+    for (r = 0; r < SWITCH_BENCH_ROUNDS; r++) {
+        asm volatile("mov %0, %%cr3" : : "r" (cr3) : "memory");
+        // half kernel image, half kernel heap, like a timer tick running the scheduler
+        for (p = 0; p < SWITCH_BENCH_PAGES/2; p++) {
+            (void)*(volatile uint8*)(0x100000 + p*0x1000);
+            (void)*(volatile uint8*)(KHEAP_START + p*0x1000);
+        }
+    }
+    return (uint32)(rdtsc() - start) / SWITCH_BENCH_ROUNDS;
+}
+
+void benchmark_switch_cost() {
+    size_t eflags = irq_save();
+
+    // make sure every page the benchmark reads is committed before timing anything
+    time_switches();
+
+    tlb_disable_global();
+    tlb_flush_all();
+    uint32 without = time_switches();
+
+    int supported = tlb_enable_global();
+    tlb_flush_all();
+    uint32 with = time_switches();
+
+    monitor_write("switch cost (cycles): ");
+    monitor_write_dec(without);
+    monitor_write(" without global pages, ");
+    monitor_write_dec(with);
+    monitor_write(supported ? " with global pages\n" : " (no PGE support)\n");
+
+    irq_restore(eflags);
+}
+
+#define CONTEXT_SWITCH_ROUNDS 1000
+
+// the benchmark's second task ping-pongs with the caller on its own stack
+static task_t bench_main, bench_partner;
+static size_t bench_stack[1024];
+
+static void bench_partner_loop() {
+    for (;;)
+        switch_to(&bench_partner, &bench_main);
+}
+
+void benchmark_context_switch() {
+    size_t eflags = irq_save();
+
+    // the frame switch_to pops the first time it switches to the partner, see process.s
+    size_t *sp = bench_stack + 1024;
+    *--sp = 0; // return address of bench_partner_loop, which never returns
+    *--sp = (size_t)&bench_partner_loop;
+    *--sp = 0; // ebp
+    *--sp = 0; // ebx
+    *--sp = 0; // esi
+    *--sp = 0; // edi
+    *--sp = 0x2; // EFLAGS with interrupts off, bit 1 is always set
+    bench_partner.esp = (size_t)sp;
+    bench_partner.cr3 = bench_main.cr3 = page_directory_physical(current_directory);
+
+    // the first round trip starts the partner
+    switch_to(&bench_main, &bench_partner);
+
+    uint64 start = rdtsc();
+    int r;
+    for (r = 0; r < CONTEXT_SWITCH_ROUNDS; r++)
+        switch_to(&bench_main, &bench_partner);
+    // every round trip is two switches
+    uint32 cycles = (uint32)(rdtsc() - start) / (2 * CONTEXT_SWITCH_ROUNDS);
+
+    monitor_write("context switch (cycles): ");
+    monitor_write_dec(cycles);
+    monitor_write("\n");
+
+    irq_restore(eflags);
 }
 
 void force_page_fault() {
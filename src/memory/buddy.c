@@ -0,0 +1,183 @@
+#include "buddy.h"
+#include "kheap.h"
+#include "../process/sync.h"
+#include "../screen/monitor.h"
+#include "../tools.h"
+
+static frame_info_t *frame_info;
+static size_t buddy_frame_count;
+
+// head of the free list for each order
+static uint32 free_lists[BUDDY_MAX_ORDER+1];
+static size_t free_blocks[BUDDY_MAX_ORDER+1];
+
+// the page fault handler allocates frames too, so every change below is made with interrupts off
+static spinlock_t buddy_lock;
+
+static void push_block(size_t frame, size_t order) {
+    frame_info_t *info = &frame_info[frame];
+    info->order = order;
+    info->flags |= FRAME_FREE;
+    info->prev = BUDDY_NONE;
+    info->next = free_lists[order];
+    if (info->next != BUDDY_NONE)
+        frame_info[info->next].prev = frame;
+    free_lists[order] = frame;
+    free_blocks[order]++;
+}
+
+static void remove_block(size_t frame, size_t order) {
+    frame_info_t *info = &frame_info[frame];
+    if (info->prev != BUDDY_NONE)
+        frame_info[info->prev].next = info->next;
+    else
+        free_lists[order] = info->next;
+    if (info->next != BUDDY_NONE)
+        frame_info[info->next].prev = info->prev;
+    info->flags &= ~FRAME_FREE;
+    free_blocks[order]--;
+}
+
+void buddy_init(size_t frame_count) {
+    spin_lock_init(&buddy_lock, "buddy");
+    buddy_frame_count = frame_count;
+    frame_info = (frame_info_t*)kmalloc(frame_count * sizeof(frame_info_t));
+    memset((uint8*)frame_info, 0, frame_count * sizeof(frame_info_t));
+
+    size_t order;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        free_lists[order] = BUDDY_NONE;
+        free_blocks[order] = 0;
+    }
+}
+
+void buddy_free_range(size_t start, size_t end) {
+    if (end > buddy_frame_count)
+        end = buddy_frame_count;
+
+    while (start < end) {
+        // the biggest block that starts here, is aligned to its own size and still fits in the range
+        size_t order = 0;
+        while (order < BUDDY_MAX_ORDER && (start & ((2 << order) - 1)) == 0 && start + (2 << order) <= end)
+            order++;
+
+        buddy_free(start, order);
+        start += 1 << order;
+    }
+}
+
+size_t buddy_alloc(size_t order) {
+    ASSERT(order <= BUDDY_MAX_ORDER);
+    size_t flags = spin_lock_irqsave(&buddy_lock);
+
+    // smallest order that has a free block
+    size_t current = order;
+    while (current <= BUDDY_MAX_ORDER && free_lists[current] == BUDDY_NONE)
+        current++;
+
+    if (current > BUDDY_MAX_ORDER) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        return BUDDY_NONE;
+    }
+
+    size_t frame = free_lists[current];
+    remove_block(frame, current);
+
+    // split, giving the upper half back each time, until the block is the requested size
+    while (current > order) {
+        current--;
+        push_block(frame + (1 << current), current);
+    }
+
+    // whoever asked for the block is its first user
+    frame_info[frame].refcount = 1;
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    return frame;
+}
+
+void buddy_free(size_t frame, size_t order) {
+    ASSERT(frame < buddy_frame_count);
+    size_t flags = spin_lock_irqsave(&buddy_lock);
+    ASSERT(!(frame_info[frame].flags & FRAME_FREE));
+
+    frame_info[frame].refcount = 0;
+
+    // merge upwards while the buddy is a free block of the same order
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy = frame ^ (1 << order);
+        if (buddy >= buddy_frame_count)
+            break;
+
+        frame_info_t *info = &frame_info[buddy];
+        if (!(info->flags & FRAME_FREE) || info->order != order)
+            break;
+
+        remove_block(buddy, order);
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+
+    push_block(frame, order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+void buddy_split(size_t frame, size_t order) {
+    ASSERT(frame + (1 << order) <= buddy_frame_count);
+
+    // buddy_free merges the frames back up as they are returned
+    size_t i;
+    for (i = 0; i < (1 << order); i++)
+        frame_info[frame + i].refcount = 1;
+}
+
+void frame_ref(size_t frame) {
+    ASSERT(frame < buddy_frame_count);
+    size_t flags = spin_lock_irqsave(&buddy_lock);
+    ASSERT(frame_info[frame].refcount > 0);
+    frame_info[frame].refcount++;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+size_t frame_unref(size_t frame) {
+    ASSERT(frame < buddy_frame_count);
+    size_t flags = spin_lock_irqsave(&buddy_lock);
+    ASSERT(frame_info[frame].refcount > 0);
+    size_t refcount = --frame_info[frame].refcount;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    return refcount;
+}
+
+size_t frame_refcount(size_t frame) {
+    ASSERT(frame < buddy_frame_count);
+    return frame_info[frame].refcount;
+}
+
+size_t buddy_free_blocks(size_t order) {
+    ASSERT(order <= BUDDY_MAX_ORDER);
+    return free_blocks[order];
+}
+
+size_t buddy_free_frames() {
+    size_t total = 0;
+    size_t order;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        total += free_blocks[order] << order;
+    return total;
+}
+
+void buddy_print_stats() {
+    monitor_write("free frames: ");
+    monitor_write_dec(buddy_free_frames());
+    monitor_write("\n");
+
+    size_t order;
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        monitor_write("  order ");
+        monitor_write_dec(order);
+        monitor_write(": ");
+        monitor_write_dec(free_blocks[order]);
+        monitor_write("\n");
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include "../tools.h"
+
+/**
+ * Binary buddy allocator for physical frames
+ * Free memory is kept as blocks of 2^order contiguous frames, one free list per order.
+ * Allocating takes the smallest block that is big enough and splits it in half until it has the requested order,
+ * freeing merges a block with its "buddy" (the other half of the block it was split from) for as long as the buddy is free.
+ * Both walk at most BUDDY_MAX_ORDER levels, so they are O(log n) instead of scanning a bitmap of every frame.
+ *
+ * Frames are referred to by index (physical address / 0x1000).
+ * The free lists and reference counts are behind an irq-safe spinlock, the page fault handler allocates and frees frames too.
+ */
+
+// largest block is 2^BUDDY_MAX_ORDER frames (4MB)
+#define BUDDY_MAX_ORDER 10
+
+// returned by buddy_alloc when no block is available, also used as the end of a free list
+#define BUDDY_NONE ((uint32)-1)
+
+// set on the first frame of a block that is sitting in a free list
+#define FRAME_FREE 0x1
+
+typedef struct frame_info {
+    uint32 next; // next free block of the same order
+    uint32 prev; // previous free block of the same order
+    uint8 order; // order of the free block starting at this frame
+    uint8 flags;
+    uint16 refcount; // number of pages mapping this frame, more than one means it is shared copy-on-write
+} frame_info_t;
+
+/**
+ * Allocates the per-frame bookkeeping for frame_count frames
+ * Every frame starts out in use, buddy_free_range hands the usable ones to the allocator
+ */
+void buddy_init(size_t frame_count);
+
+// adds frames [start, end) to the allocator in the largest aligned blocks that fit
+void buddy_free_range(size_t start, size_t end);
+
+// returns the first frame of a block of 2^order frames, or BUDDY_NONE
+size_t buddy_alloc(size_t order);
+
+// returns a block previously handed out by buddy_alloc with the same order
+void buddy_free(size_t frame, size_t order);
+
+/**
+ * Turns an allocated block of 2^order frames into 2^order separately allocated frames
+ * Each of them can then be freed on its own with buddy_free(frame, 0), used to allocate many single frames at once
+ */
+void buddy_split(size_t frame, size_t order);
+
+// another page now maps this (allocated) frame
+void frame_ref(size_t frame);
+
+// a page stopped mapping this frame, returns how many pages still map it
+size_t frame_unref(size_t frame);
+
+size_t frame_refcount(size_t frame);
+
+// number of free blocks of the given order
+size_t buddy_free_blocks(size_t order);
+
+// total number of free frames across all orders
+size_t buddy_free_frames();
+
+// prints the free block count for every order
+void buddy_print_stats();
+
+#endif
@@ -1,5 +1,7 @@
 #include "kheap.h"
 #include "paging.h"
+#include "tlsf.h"
+#include "slab.h"
 #include "../screen/monitor.h"
 #include "../tools.h"
 
@@ -9,17 +11,15 @@ extern size_t end;
 size_t placement_address = (size_t) &end;
 extern page_directory_t *kernel_directory;
 heap_t *kheap=0;
+uint8 heap_backend = HEAP_BACKEND_TLSF;
+static kmem_cache_t *heap_cache = 0;
 
 size_t kmalloc_int(size_t sz, int align, size_t *phys) {
     if (kheap != 0) {
         void *addr = alloc(sz, (uint8)align, kheap);
         if (phys) {
-            page_t *page = get_page((size_t)addr, 0, kernel_directory);
-            // bitshifted right by 12 bits, move back
-            size_t frame_address = page->frame << 12;
-            // TODO: figure out why this would be needed
-            size_t unknown_offset = ((size_t)addr)&0xFFF;
-            *phys = frame_address + unknown_offset;
+            // heap pages are committed on first touch, virtual_to_physical takes care of that
+            *phys = virtual_to_physical((size_t)addr);
         }
         return (size_t)addr;
     } else {
@@ -57,32 +57,27 @@ size_t kmalloc(size_t sz) {
     return kmalloc_int(sz, 0, 0);
 }
 
-static void expand(size_t new_size, heap_t *heap) {
+void expand(size_t new_size, heap_t *heap) {
     ASSERT(new_size > heap->end_address - heap->start_address);
 
-    if ((new_size&0xFFFFF000) != 0) {
+    if ((new_size&0x00000FFF) != 0) {
         new_size &= 0xFFFFF000;
         new_size += PAGE_SIZE;
     }
 
     ASSERT(heap->start_address+new_size <= heap->max_address);
 
-    size_t old_size = heap->end_address-heap->start_address;
-
-    size_t i = old_size;
-    while (i < new_size) {
-        alloc_frame(get_page(heap->start_address+i, 1, kernel_directory), (heap->supervisor)?1:0, (heap->readonly)?0:1);
-        i += PAGE_SIZE;
-    }
-
+    // frames are committed by the page fault handler on first touch (the heap lives in a VM_HEAP region)
+    // and the page tables up to KHEAP_MAX were all created at boot and are linked into every address space
+    // so growing is just moving the end
     heap->end_address = heap->start_address+new_size;
 }
 
-static size_t contract(size_t new_size, heap_t *heap) {
+size_t contract(size_t new_size, heap_t *heap) {
     ASSERT(new_size < heap->end_address-heap->start_address);
 
-    if (new_size&PAGE_SIZE) {
-        new_size &= PAGE_SIZE;
+    if (new_size&0x00000FFF) {
+        new_size &= 0xFFFFF000;
         new_size += PAGE_SIZE;
     }
 
@@ -90,11 +85,8 @@ static size_t contract(size_t new_size, heap_t *heap) {
         new_size = HEAP_MIN_SIZE;
 
     size_t old_size = heap->end_address-heap->start_address;
-    size_t i = old_size - PAGE_SIZE;
-    while (new_size < i) {
-        free_frame(get_page(heap->start_address+i, 0, kernel_directory));
-        i -= PAGE_SIZE;
-    }
+    // pages that were never touched have no frame and are skipped, the rest are invalidated in one batch
+    unmap_range(kernel_directory, heap->start_address+new_size, old_size-new_size);
 
     heap->end_address = heap->start_address + new_size;
     return new_size;
@@ -133,12 +125,33 @@ static int8 header_t_less_than(void*a, void *b) {
     return (((header_t*)a)->size < ((header_t*)b)->size)?1:0;
 }
 
+void create_heap_cache() {
+    heap_cache = kmem_cache_create("heap", sizeof(heap_t), 0, 0);
+}
+
+void set_heap_backend(uint8 backend) {
+    heap_backend = backend;
+}
+
 heap_t *create_heap(size_t start, size_t end_addr, size_t max, uint8 supervisor, uint8 readonly) {
-    heap_t *heap = (heap_t*)kmalloc(sizeof(heap_t));
+    heap_t *heap = (heap_t*)kmem_cache_alloc(heap_cache);
 
     // assumptions are based on the heap start and end address being page aligned, so make sure they are
     ASSERT(start%PAGE_SIZE == 0);
     ASSERT(end_addr%PAGE_SIZE == 0);
+
+    heap->backend = heap_backend;
+    heap->max_address = max;
+    heap->supervisor = supervisor;
+    heap->readonly = readonly;
+    heap->tlsf = 0;
+    spin_lock_init(&heap->lock, "heap");
+
+    if (heap->backend == HEAP_BACKEND_TLSF) {
+        // the TLSF control structure replaces the index at the start of the heap
+        tlsf_init(heap, start, end_addr);
+        return heap;
+    }
     
     // create heap index
     heap->index = place_ordered_array( (void*)start, HEAP_INDEX_SIZE, &header_t_less_than);
@@ -154,9 +167,6 @@ heap_t *create_heap(size_t start, size_t end_addr, size_t max, uint8 supervisor,
 
     heap->start_address = start;
     heap->end_address = end_addr;
-    heap->max_address = max;
-    heap->supervisor = supervisor;
-    heap->readonly = readonly;
 
     header_t *hole = (header_t *)start;
     hole->size = end_addr-start;
@@ -167,7 +177,7 @@ heap_t *create_heap(size_t start, size_t end_addr, size_t max, uint8 supervisor,
     return heap;
 }
 
-void *alloc(size_t size, uint8 page_align, heap_t *heap) {
+static void *ordered_alloc(size_t size, uint8 page_align, heap_t *heap) {
     // add size of header and footer to size to allocate
     size_t new_size = size + sizeof(header_t) + sizeof(footer_t);
     // find the smallest hole to allocate the new page(s) in
@@ -214,7 +224,7 @@ void *alloc(size_t size, uint8 page_align, heap_t *heap) {
             footer->magic = HEAP_MAGIC;
         }
    
-        return alloc(size, page_align, heap);
+        return ordered_alloc(size, page_align, heap);
     }
 
     // get the header for the index retrieved from find_smallest_hole
@@ -284,7 +294,7 @@ void *alloc(size_t size, uint8 page_align, heap_t *heap) {
     return (void *) ( (size_t)block_header+sizeof(header_t) );
 }
 
-void free(void *p, heap_t *heap) {
+static void ordered_free(void *p, heap_t *heap) {
     if (p == 0)
         return;
 
@@ -348,3 +358,24 @@ void free(void *p, heap_t *heap) {
         insert_ordered_array((void*)header, &heap->index);
 
 }
+
+void *alloc(size_t size, uint8 page_align, heap_t *heap) {
+    // pages the allocator touches for the first time fault in with the lock held, the fault path never allocates from the heap
+    size_t flags = spin_lock_irqsave(&heap->lock);
+    void *p;
+    if (heap->backend == HEAP_BACKEND_TLSF)
+        p = tlsf_alloc(size, page_align, heap);
+    else
+        p = ordered_alloc(size, page_align, heap);
+    spin_unlock_irqrestore(&heap->lock, flags);
+    return p;
+}
+
+void free(void *p, heap_t *heap) {
+    size_t flags = spin_lock_irqsave(&heap->lock);
+    if (heap->backend == HEAP_BACKEND_TLSF)
+        tlsf_free(p, heap);
+    else
+        ordered_free(p, heap);
+    spin_unlock_irqrestore(&heap->lock, flags);
+}
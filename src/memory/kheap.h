@@ -5,6 +5,7 @@
 #include "../tools.h"
 #include "../utils/ordered_array.h"
 #include "paging.h"
+#include "../process/sync.h"
 
 /**
  * The kernel heap is necessary for dynamic memory allocation
@@ -14,11 +15,16 @@
 
 #define KHEAP_START         0xC0000000
 #define KHEAP_INITIAL_SIZE  0x100000 // 1MB
+#define KHEAP_MAX           0xCFFFF000 // the heap may grow up to here
 
 #define HEAP_INDEX_SIZE   0x20000
 #define HEAP_MAGIC        0x123890AB // a random number used to easily identity the header/footer part of memory
 #define HEAP_MIN_SIZE     0x70000
 
+// heap implementations that can be chosen at boot, see set_heap_backend()
+#define HEAP_BACKEND_TLSF     0 // two-level segregated fit, O(1) alloc/free (default)
+#define HEAP_BACKEND_ORDERED  1 // original ordered array of holes, linear search
+
 typedef struct {
     size_t magic; // header/footer identifier
     uint8 is_hole; // 0 is block, 1 if hole
@@ -30,21 +36,44 @@ typedef struct {
     header_t *header; // pointer to the header_t struct
 } footer_t;
 
+struct tlsf_control;
+
 typedef struct {
-    ordered_array_t index;
+    uint8 backend; // HEAP_BACKEND_* this heap was created with
+    ordered_array_t index; // holes sorted by size, only used by the ordered backend
+    struct tlsf_control *tlsf; // segregated free lists, only used by the TLSF backend
     size_t start_address;
     size_t end_address;
     size_t max_address;
     uint8 supervisor;
     uint8 readonly;
+    spinlock_t lock; // taken by alloc() and free(), irq-safe since the #NM handler can grow a slab cache
 } heap_t;
 
+/**
+ * Selects the implementation used by heaps created after this call
+ * Must be called before initialise_paging() to affect the kernel heap
+ */
+void set_heap_backend(uint8 backend);
+
+/**
+ * Creates the cache heap_t structures come from
+ * Must be called before the identity map is set up, since the kernel heap's own heap_t is allocated before the heap exists
+ */
+void create_heap_cache();
+
 heap_t *create_heap(size_t start, size_t end, size_t max, uint8 supervisor, uint8 readonly);
 
 void *alloc(size_t size, uint8 page_align, heap_t *heap);
 
 void free(void *p, heap_t *heap);
 
+// grow the heap to new_size bytes (measured from start_address), mapping frames for the new pages
+void expand(size_t new_size, heap_t *heap);
+
+// shrink the heap to new_size bytes and free the frames behind it, returns the size actually kept
+size_t contract(size_t new_size, heap_t *heap);
+
 size_t kmalloc_int(size_t sz, int align, size_t *phys);
 
 // ensure allocated memory is page aligned
@@ -0,0 +1,71 @@
+#include "kmap.h"
+#include "paging.h"
+#include "tlb.h"
+#include "../tools.h"
+
+extern page_directory_t *kernel_directory;
+
+// page table entries of the slots, slot i maps KMAP_BASE + i*0x1000
+static page_t *slots;
+// bit i set while slot i is in use
+static uint32 used = 0;
+
+void kmap_init() {
+    ASSERT(KMAP_SLOTS <= 32);
+    slots = get_page(KMAP_BASE, 1, kernel_directory);
+}
+
+void *kmap(size_t physical) {
+    // an interrupt handler (copy-on-write fault, task switch) may need a slot too
+    size_t eflags = irq_save();
+
+    size_t i;
+    for (i = 0; i < KMAP_SLOTS; i++)
+        if (!(used & (1 << i)))
+            break;
+    if (i == KMAP_SLOTS) {
+        PANIC("No free kmap slots!");
+    }
+    used |= 1 << i;
+
+    irq_restore(eflags);
+
+    page_t *page = &slots[i];
+    page->present = 1;
+    page->rw = 1;
+    page->user = 0;
+    page->frame = physical / 0x1000;
+
+    // kunmap dropped whatever the slot mapped last time from the TLB, a not-present entry is never cached
+    return (void*)(KMAP_BASE + i*0x1000);
+}
+
+void kunmap(void *virtual) {
+    size_t i = ((size_t)virtual - KMAP_BASE) / 0x1000;
+    ASSERT(i < KMAP_SLOTS && (used & (1 << i)));
+
+    // the frame must not stay reachable through the slot once it is given back
+    // always right away, a tlb batch may be open around us (e.g. clone_directory)
+    slots[i].present = 0;
+    slots[i].frame = 0;
+    tlb_flush_page((size_t)virtual & 0xFFFFF000);
+
+    // kmap changes the same word from interrupt handlers
+    size_t eflags = irq_save();
+    used &= ~(1 << i);
+    irq_restore(eflags);
+}
+
+void copy_page_physical(size_t src, size_t dst) {
+    void *from = kmap(src);
+    void *to = kmap(dst);
+    copy_page(to, from);
+    kunmap(to);
+    kunmap(from);
+}
+
+void zero_page_physical(size_t address) {
+    void *page = kmap(address);
+    zero_page(page);
+    kunmap(page);
+}
@@ -0,0 +1,37 @@
+#ifndef KMAP_H
+#define KMAP_H
+
+#include "../tools.h"
+
+/**
+ * Temporary mappings of physical frames (kmap)
+ * A handful of virtual pages at KMAP_BASE are reserved for mapping an arbitrary frame for a short time,
+ * e.g. to copy or zero a frame that is not mapped anywhere in the current address space.
+ * Their page table is created at boot in the kernel directory, so every cloned directory shares the window.
+ * This replaces turning paging off (and losing the whole TLB) to reach a frame by its physical address.
+ */
+
+// last directory slot but one, the window owns its 4MB of address space
+#define KMAP_BASE  0xFF800000
+#define KMAP_SLOTS 16
+
+// creates the window's page table, must run before the identity map is set up
+void kmap_init();
+
+// maps the frame at physical address and returns the virtual address it can be reached at
+void *kmap(size_t physical);
+
+// releases a slot returned by kmap, its mapping is removed and flushed from the TLB
+void kunmap(void *virtual);
+
+// copies the frame at src into the frame at dst, paging stays on
+void copy_page_physical(size_t src, size_t dst);
+
+// fills the frame at address with zeros
+void zero_page_physical(size_t address);
+
+// defined in process.s, copy/fill a whole page with rep movsd/stosd, both addresses are virtual and page aligned
+extern void copy_page(void *dst, void *src);
+extern void zero_page(void *dst);
+
+#endif
@@ -0,0 +1,130 @@
+#include "memmap.h"
+#include "../tools.h"
+
+extern size_t code; // start of the kernel image, from link.ld
+extern size_t end; // end of the kernel image, from link.ld
+
+static mem_region_t regions[MEMMAP_MAX_REGIONS];
+static size_t region_count = 0;
+
+static void add_region(size_t start, size_t end_addr) {
+    // only whole frames are usable
+    start = (start + 0xFFF) & 0xFFFFF000;
+    end_addr &= 0xFFFFF000;
+
+    if (start >= end_addr)
+        return;
+
+    ASSERT(region_count < MEMMAP_MAX_REGIONS);
+    regions[region_count].start = start;
+    regions[region_count].end = end_addr;
+    region_count++;
+}
+
+/**
+ * Copies the usable regions out of the multiboot memory map
+ * Entries above 4GB are ignored since we cannot address them, an entry crossing 4GB is cut short
+ */
+static void read_mmap(struct multiboot *mboot_ptr) {
+    size_t entry_address = mboot_ptr->mmap_addr;
+
+    while (entry_address < mboot_ptr->mmap_addr + mboot_ptr->mmap_length) {
+        multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t*)entry_address;
+
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->base_addr_high == 0) {
+            size_t start = entry->base_addr_low;
+            size_t end_addr = start + entry->length_low;
+            if (entry->length_high != 0 || end_addr < start)
+                end_addr = 0xFFFFF000;
+            add_region(start, end_addr);
+        }
+
+        // size does not count the size field itself
+        entry_address += entry->size + sizeof(entry->size);
+    }
+}
+
+void memmap_init(struct multiboot *mboot_ptr) {
+    region_count = 0;
+
+    if (mboot_ptr->flags & MULTIBOOT_FLAG_MMAP) {
+        read_mmap(mboot_ptr);
+    } else if (mboot_ptr->flags & MULTIBOOT_FLAG_MEM) {
+        // only the amount of lower (below 1MB) and upper (above 1MB) memory in KB is known
+        add_region(0, mboot_ptr->mem_lower * 1024);
+        add_region(0x100000, 0x100000 + mboot_ptr->mem_upper * 1024);
+    } else {
+        add_region(0, MEMMAP_DEFAULT_END);
+    }
+
+    // the kernel image itself
+    memmap_reserve((size_t)&code, (size_t)&end);
+
+    // boot modules such as the initrd, each entry is start, end, string, reserved
+    if (mboot_ptr->flags & MULTIBOOT_FLAG_MODS) {
+        size_t i;
+        for (i = 0; i < mboot_ptr->mods_count; i++) {
+            size_t *module = (size_t*)(mboot_ptr->mods_addr + i*16);
+            memmap_reserve(module[0], module[1]);
+        }
+    }
+}
+
+void memmap_reserve(size_t start, size_t end_addr) {
+    // reserve whole frames, so round outwards
+    start &= 0xFFFFF000;
+    end_addr = (end_addr + 0xFFF) & 0xFFFFF000;
+
+    size_t i = 0;
+    while (i < region_count) {
+        mem_region_t *region = &regions[i];
+
+        if (end_addr <= region->start || start >= region->end) {
+            i++;
+            continue;
+        }
+
+        if (start > region->start && end_addr < region->end) {
+            // the reserved range is in the middle, split the region in two
+            size_t old_end = region->end;
+            region->end = start;
+            add_region(end_addr, old_end);
+            i++;
+        } else if (start > region->start) {
+            region->end = start;
+            i++;
+        } else if (end_addr < region->end) {
+            region->start = end_addr;
+            i++;
+        } else {
+            // fully covered, drop the region by moving the last one into its slot
+            regions[i] = regions[--region_count];
+        }
+    }
+}
+
+size_t memmap_end() {
+    size_t highest = 0;
+    size_t i;
+    for (i = 0; i < region_count; i++)
+        if (regions[i].end > highest)
+            highest = regions[i].end;
+    return highest;
+}
+
+size_t memmap_region_count() {
+    return region_count;
+}
+
+mem_region_t *memmap_region(size_t index) {
+    ASSERT(index < region_count);
+    return &regions[index];
+}
+
+size_t memmap_usable() {
+    size_t total = 0;
+    size_t i;
+    for (i = 0; i < region_count; i++)
+        total += regions[i].end - regions[i].start;
+    return total;
+}
@@ -0,0 +1,42 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include "../tools.h"
+#include "../multiboot.h"
+
+/**
+ * Physical memory map
+ * GRUB tells us which physical ranges are usable RAM through the multiboot memory map (mmap_addr/mmap_length).
+ * Everything else (ACPI tables, memory mapped devices, the BIOS area, ...) is left out.
+ * The usable ranges are copied into a small table here before anything can overwrite GRUB's copy,
+ * and the kernel image and boot modules (initrd) are cut out of them.
+ * initialise_paging() sizes the frame allocator from this table and hands each region to it as a whole.
+ */
+
+#define MEMMAP_MAX_REGIONS 32
+
+// used when GRUB gives us no memory information at all
+#define MEMMAP_DEFAULT_END 0x1000000
+
+typedef struct {
+    size_t start; // first byte, page aligned
+    size_t end; // one past the last byte, page aligned
+} mem_region_t;
+
+// reads the usable regions out of the multiboot info and reserves the kernel image and modules
+void memmap_init(struct multiboot *mboot_ptr);
+
+// removes [start, end) from the usable regions
+void memmap_reserve(size_t start, size_t end);
+
+// end of the highest usable region, i.e. how much physical memory the frame allocator has to track
+size_t memmap_end();
+
+size_t memmap_region_count();
+
+mem_region_t *memmap_region(size_t index);
+
+// total usable bytes
+size_t memmap_usable();
+
+#endif
@@ -1,76 +1,210 @@
 
 #include "paging.h"
 #include "kheap.h"
+#include "buddy.h"
+#include "memmap.h"
+#include "vm_region.h"
+#include "tlb.h"
+#include "kmap.h"
+#include "zero_pool.h"
+#include "pt_pool.h"
 #include "../tools.h"
 #include "../screen/monitor.h"
 
 page_directory_t *kernel_directory=0;
 page_directory_t *current_directory=0;
 
-// bitset of frames used/free
-size_t *frames;
+// number of physical frames, managed by the buddy allocator in buddy.c
 size_t frame_count;
 
+// set when the CPU supports 4MB pages, the identity map and kernel heap then use them
+static int pse_enabled = 0;
+
 extern size_t placement_address;
 extern heap_t *kheap;
-extern void copy_page_physical(size_t, size_t);
 
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
+// directory slots covered by the identity map, 0 until the identity map is set up
+static size_t identity_slots = 0;
 
-static void set_frame(size_t frame_addr) {
-    size_t frame = frame_addr/0x1000;
-    size_t idx = INDEX_FROM_BIT(frame);
-    size_t off = OFFSET_FROM_BIT(frame);
-    frames[idx] |= (0x1 << off);
+/**
+ * Points the page at a specific frame
+ * Not global: frames from alloc_frame can be private to an address space (e.g. the task stack)
+ */
+static void map_frame(page_t *page, size_t frame_address, int is_kernel, int is_writeable) {
+    page->present = 1;
+    page->rw = (is_writeable)?1:0;
+    page->user = (is_kernel)?0:1;
+    page->frame = frame_address / 0x1000;
 }
 
-static void clear_frame(size_t frame_addr) {
-    size_t frame = frame_addr/0x1000;
-    size_t idx = INDEX_FROM_BIT(frame);
-    size_t off = OFFSET_FROM_BIT(frame);
-    frames[idx] &= ~(0x1 << off);
+// points a directory slot at a page table, present, read-write, user mode accessible
+static void set_table_entry(page_dir_entry_t *entry, size_t table_physical) {
+    entry->present = 1;
+    entry->rw = 1;
+    entry->user = 1;
+    entry->frame = table_physical / 0x1000;
 }
 
-static size_t test_frame(size_t frame_addr) {
-    size_t frame = frame_addr/0x1000;
-    size_t idx = INDEX_FROM_BIT(frame);
-    size_t off = OFFSET_FROM_BIT(frame);
-    return (frames[idx] & (0x1 << off));
+// points the last slot of dir at dir itself, supervisor only so user mode cannot see the page tables
+static void set_self_entry(page_directory_t *dir, size_t dir_physical) {
+    page_dir_entry_t *entry = &dir->entries[PAGE_DIRECTORY_SELF];
+    entry->present = 1;
+    entry->rw = 1;
+    entry->user = 0;
+    entry->frame = dir_physical / 0x1000;
 }
 
-static size_t first_frame() {
-    size_t i, j;
-    for (i = 0; i < INDEX_FROM_BIT(frame_count); i++) {
-        if (frames[i] != 0xFFFFFFFF) {
-           
-            for (j = 0; j < 32; j++) {
-                size_t toTest = 0x1 << j;
-                if ( !(frames[i]&toTest) ) {
-                    return i*4*8+j;
-                }
-            }
-        }
+/**
+ * Maps the 4MB at address to the 4MB aligned block at frame_address with a single directory entry
+ */
+static void map_large_page(page_directory_t *dir, size_t address, size_t frame_address, int is_kernel, int is_writeable) {
+    size_t table_index = address / LARGE_PAGE_SIZE;
+    ASSERT(!dir->entries[table_index].present);
+    ASSERT((frame_address & (LARGE_PAGE_SIZE-1)) == 0);
+
+    page_dir_entry_t *entry = &dir->entries[table_index];
+    entry->present = 1;
+    entry->rw = (is_writeable)?1:0;
+    entry->user = (is_kernel)?0:1;
+    entry->large = 1;
+    // large pages only map memory that is shared by every address space
+    entry->global = 1;
+    entry->frame = frame_address / 0x1000;
+}
+
+/**
+ * Whether the page table in slot table_index of dir can be reached through the recursive mapping,
+ * i.e. dir is active or the table is shared with the active directory (kernel tables)
+ */
+static int table_is_live(page_directory_t *dir, size_t table_index) {
+    if (dir == current_directory)
+        return 1;
+    page_dir_entry_t *live = &current_directory->entries[table_index];
+    return live->present && !live->large && live->frame == dir->entries[table_index].frame;
+}
+
+/**
+ * Returns the page table in slot table_index of dir, which must be present
+ * A table of a directory that is not active gets a kmap slot of its own, the caller gives it back with release_table
+ */
+static page_table_t *page_table(page_directory_t *dir, size_t table_index) {
+    size_t physical = dir->entries[table_index].frame * 0x1000;
+
+    if (!current_directory) {
+        // paging is not enabled yet, tables are addressed physically
+        return (page_table_t*)physical;
+    } else if (table_is_live(dir, table_index)) {
+        return (page_table_t*)PAGE_TABLES_VIRTUAL + table_index;
+    } else {
+        return (page_table_t*)kmap(physical);
     }
 }
 
-void alloc_frame(page_t *page, int is_kernel, int is_writeable) {
+static int table_is_kmapped(page_table_t *table) {
+    return (size_t)table >= KMAP_BASE && (size_t)table < KMAP_BASE + KMAP_SLOTS*0x1000;
+}
+
+// done with a table returned by page_table or find_table, 0 is ignored
+static void release_table(page_table_t *table) {
+    if (table && table_is_kmapped(table))
+        kunmap(table);
+}
+
+/**
+ * Gives slot table_index of dir a new, zeroed page table
+ */
+static void create_table(page_directory_t *dir, size_t table_index) {
+    size_t table;
+
+    if (!current_directory && !identity_slots) {
+        // placement memory, which ends up inside the identity map
+        table = kmalloc_a(sizeof(page_table_t));
+        memset((uint8*)table, 0, sizeof(page_table_t));
+    } else if (!current_directory) {
+        // placement memory can no longer move, but the frame allocator is up and frames are still addressed physically
+        table = alloc_frames(0);
+        memset((uint8*)table, 0, sizeof(page_table_t));
+    } else {
+        table = pt_alloc_table();
+    }
+
+    set_table_entry(&dir->entries[table_index], table);
+
+    // the table's window page may still be cached from a table that used to live in this slot
+    if (current_directory && table_is_live(dir, table_index))
+        tlb_flush_page(PAGE_TABLES_VIRTUAL + table_index*0x1000);
+}
+
+/**
+ * Returns the page table covering address in dir, creating it if make is set, and 0 if there is none or a large page maps it
+ * Must be given back with release_table
+ */
+static page_table_t *find_table(size_t address, int make, page_directory_t *dir) {
+    size_t table_index = address / 0x400000;
+    page_dir_entry_t *entry = &dir->entries[table_index];
+    ASSERT(table_index != PAGE_DIRECTORY_SELF);
+
+    if (entry->large) {
+        // mapped by a large page, there is no page table to look into or create
+        return 0;
+    } else if (!entry->present) {
+        if (!make)
+            return 0;
+        create_table(dir, table_index);
+    }
+    return page_table(dir, table_index);
+}
+
+/**
+ * Slots that hold the same entry in every address space: the identity map, the kernel heap and the kmap/directory windows
+ * Their page tables all exist from boot on, so they never have to be synchronized between directories
+ */
+static int is_kernel_slot(size_t table_index) {
+    return table_index < identity_slots
+        || (table_index >= KHEAP_START / 0x400000 && table_index <= (KHEAP_MAX - 1) / 0x400000)
+        || (table_index >= PT_DIR_WINDOW / 0x400000 && table_index < PAGE_DIRECTORY_SELF);
+}
+
+// copies the kernel slots of the kernel directory into dir, which links all of the kernel's page tables
+static void link_kernel_slots(page_directory_t *dir) {
+    size_t heap_first = KHEAP_START / 0x400000;
+    size_t heap_last = (KHEAP_MAX - 1) / 0x400000;
+    size_t windows = PT_DIR_WINDOW / 0x400000;
+
+    memcpy((uint8*)dir->entries, (uint8*)kernel_directory->entries, identity_slots * sizeof(page_dir_entry_t));
+    memcpy((uint8*)&dir->entries[heap_first], (uint8*)&kernel_directory->entries[heap_first],
+           (heap_last + 1 - heap_first) * sizeof(page_dir_entry_t));
+    memcpy((uint8*)&dir->entries[windows], (uint8*)&kernel_directory->entries[windows],
+           (PAGE_DIRECTORY_SELF - windows) * sizeof(page_dir_entry_t));
+}
+
+static int cpu_has_pse() {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & 0x8) != 0; // bit 3: page size extension
+}
+
+void alloc_frame(page_t *page, int is_kernel, int is_writeable, int is_zeroed) {
     if (page->frame != 0) {
         // frame already allocated
         return;
     } else {
-        // find available frame, 
-        size_t frame_address = first_frame();
-
-        if (frame_address == (size_t)-1) {
+        // take a single frame (order 0) from the buddy allocator, or one the idle loop already zeroed
+        // zero_pool_alloc only falls back on the allocator once the pool is empty, so it has nothing left to steal
+        size_t frame;
+        if (is_zeroed) {
+            frame = zero_pool_alloc();
+        } else {
+            frame = buddy_alloc(0);
+            // the zeroed pool is the last reserve when the allocator runs dry
+            if (frame == BUDDY_NONE)
+                frame = zero_pool_steal();
+        }
+        if (frame == BUDDY_NONE) {
             PANIC("No free frames!");
         }
-        
-        set_frame(frame_address*0x1000);
-        page->present = 1;
-        page->rw = (is_writeable)?1:0;
-        page->user = (is_kernel)?0:1;
-        page->frame = frame_address;
+
+        map_frame(page, frame * 0x1000, is_kernel, is_writeable);
     }
 }
 
@@ -79,48 +213,260 @@ void free_frame(page_t *page) {
     if (!(frame=page->frame)) {
         return;
     } else {
-        clear_frame(frame);
+        // a copy-on-write frame is still in use by another address space
+        if (frame_unref(frame) == 0)
+            buddy_free(frame, 0);
         page->frame = 0x0;
+        page->present = 0;
+        page->cow = 0;
+        page->global = 0;
+    }
+}
+
+void unmap_page(size_t address, page_directory_t *dir) {
+    page_table_t *table = find_table(address, 0, dir);
+    if (!table)
+        return;
+
+    page_t *page = &table->pages[(address / 0x1000) % 1024];
+    if (page->present) {
+        free_frame(page);
+
+        // tables shared with the active directory (e.g. kernel tables) may be cached
+        if (table_is_live(dir, address / 0x400000))
+            tlb_invalidate(address);
     }
+    release_table(table);
+}
+
+size_t alloc_frames(size_t order) {
+    size_t frame = buddy_alloc(order);
+    if (frame == BUDDY_NONE && order == 0)
+        frame = zero_pool_steal();
+    if (frame == BUDDY_NONE) {
+        PANIC("No free frames!");
+    }
+    return frame * 0x1000;
+}
+
+void free_frames(size_t address, size_t order) {
+    buddy_free(address / 0x1000, order);
+}
+
+// points a not-present page at frame (an index) with the permissions in the MAP_* flags
+static void set_page(page_t *page, size_t frame, size_t flags) {
+    page->present = 1;
+    page->rw = (flags & MAP_WRITABLE)?1:0;
+    page->user = (flags & MAP_USER)?1:0;
+    page->global = (flags & MAP_GLOBAL)?1:0;
+    page->frame = frame;
+}
+
+/**
+ * Fills the page table entries for the pages in [start, end), one page table at a time
+ * The range maps onto the frames starting at physical, or onto newly allocated frames if physical is BUDDY_NONE
+ */
+static void fill_range(page_directory_t *dir, size_t start, size_t end, size_t physical, size_t flags) {
+    // frames of the last block taken from the buddy allocator that are not mapped yet
+    size_t run = 0, run_left = 0;
+    size_t address = start;
+
+    while (address < end) {
+        // first address of the next page table, or the end of the range
+        size_t table_end = (address & 0xFFC00000) + 0x400000;
+        if (table_end > end)
+            table_end = end;
+
+        // creates the page table if needed, 0 if a large page covers it
+        page_table_t *table = find_table(address, 1, dir);
+
+        if (!table || (flags & MAP_TABLES_ONLY)) {
+            release_table(table);
+            address = table_end;
+            continue;
+        }
+
+        page_t *page = &table->pages[(address / 0x1000) % 1024];
+        for (; address < table_end; address += 0x1000, page++) {
+            if (page->present || page->frame)
+                continue;
+
+            if (physical != BUDDY_NONE) {
+                set_page(page, (physical + address - start) / 0x1000, flags);
+                continue;
+            }
+
+            if (flags & MAP_ZERO) {
+                size_t frame = zero_pool_alloc();
+                if (frame == BUDDY_NONE) {
+                    PANIC("No free frames!");
+                }
+                set_page(page, frame, flags);
+                continue;
+            }
+
+            if (run_left == 0) {
+                // a block as large as the rest of this table, or the largest one still free
+                size_t pages = (table_end - address) / 0x1000;
+                size_t order = 0;
+                while (order < BUDDY_MAX_ORDER && (2 << order) <= pages)
+                    order++;
+                while ((run = buddy_alloc(order)) == BUDDY_NONE && order > 0)
+                    order--;
+
+                if (run == BUDDY_NONE) {
+                    run = zero_pool_steal();
+                    order = 0;
+                }
+                if (run == BUDDY_NONE) {
+                    PANIC("No free frames!");
+                }
+
+                buddy_split(run, order);
+                run_left = 1 << order;
+            }
+
+            set_page(page, run++, flags);
+            run_left--;
+        }
+
+        release_table(table);
+    }
+
+    // pages that were mapped already may leave part of the last block unused
+    while (run_left > 0) {
+        buddy_free(run++, 0);
+        run_left--;
+    }
+}
+
+void map_range(page_directory_t *dir, size_t vaddr, size_t len, size_t flags) {
+    size_t end = (vaddr + len + 0xFFF) & 0xFFFFF000;
+    fill_range(dir, vaddr & 0xFFFFF000, end, BUDDY_NONE, flags);
+}
+
+void map_range_physical(page_directory_t *dir, size_t vaddr, size_t paddr, size_t len, size_t flags) {
+    size_t end = (vaddr + len + 0xFFF) & 0xFFFFF000;
+    fill_range(dir, vaddr & 0xFFFFF000, end, paddr & 0xFFFFF000, flags);
+}
+
+void unmap_range(page_directory_t *dir, size_t vaddr, size_t len) {
+    size_t address = vaddr & 0xFFFFF000;
+    size_t end = (vaddr + len + 0xFFF) & 0xFFFFF000;
+
+    tlb_batch_begin();
+    while (address < end) {
+        size_t table_end = (address & 0xFFC00000) + 0x400000;
+        if (table_end > end)
+            table_end = end;
+
+        page_table_t *table = find_table(address, 0, dir);
+        if (!table) {
+            // no page table (or a large page), nothing mapped here
+            address = table_end;
+            continue;
+        }
+
+        // tables shared with the active directory (e.g. kernel tables) may be cached
+        int live = table_is_live(dir, address / 0x400000);
+        page_t *page = &table->pages[(address / 0x1000) % 1024];
+        for (; address < table_end; address += 0x1000, page++) {
+            if (!page->present)
+                continue;
+            free_frame(page);
+            if (live)
+                tlb_invalidate(address);
+        }
+
+        release_table(table);
+    }
+    tlb_batch_end();
 }
 
 void initialise_paging() {
-    // specifies the size of memory
-    // assume 16MB for now
-    size_t mem_end_page = 0x1000000;
-    
-    frame_count = mem_end_page / 0x1000;
-    frames = (size_t*) kmalloc(INDEX_FROM_BIT(frame_count));
-    memset(frames, 0, INDEX_FROM_BIT(frame_count));
+    // track every frame up to the highest usable address GRUB reported (see memmap_init)
+    frame_count = memmap_end() / 0x1000;
+    // every frame starts out reserved, the usable ones outside the identity map are freed below
+    buddy_init(frame_count);
+
+    create_heap_cache();
 
-    size_t phys;
+    // placement memory, the directory's physical address is its address
+    // every other directory comes from the paging structure pool (pt_pool.c)
     kernel_directory = (page_directory_t*)kmalloc_a(sizeof(page_directory_t));
-    memset(kernel_directory, 0, sizeof(page_directory_t));
-    kernel_directory->physical_address_of_tables_physical = (size_t)kernel_directory->tables_physical;
+    memset((uint8*)kernel_directory, 0, sizeof(page_directory_t));
+    set_self_entry(kernel_directory, (size_t)kernel_directory);
+
+    pse_enabled = cpu_has_pse();
 
-    // map pages for the kernel heap addresses (creates page tables)
+    // the page tables of the temporary mapping window and the directory window, linked into every directory cloned from this one
+    kmap_init();
+    pt_pool_init();
+
+    // create the page tables for every address the kernel heap may ever use
+    // every address space cloned from the kernel directory links them, so heap growth shows up everywhere at once
     // we cannot change the placement_address between identity mapping and enabling paging
     // so we create any page tables that need to be allocated for the heap here
-    // and will allocate the pages after identity-mapping 
-    int i = 0;
-    for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += 0x1000) {
-        get_page(i, 1, kernel_directory);
-    }
+    // the heap pages themselves are demand paged, they get a frame when they are first touched
+    // with PSE the first 4MB is left for the large page mapped below
+    size_t heap_tables = (pse_enabled) ? KHEAP_START + LARGE_PAGE_SIZE : KHEAP_START;
+    map_range(kernel_directory, heap_tables, KHEAP_MAX - heap_tables, MAP_TABLES_ONLY);
 
     // identity mapped paging: the virtual page addresses are equal to the physical frame addresses
     // we need to do this to access memory as if paging was not enabled (since it will not be enabled until switch_page_directory is called)
-    i = 0;
-    while (i < placement_address+0x1000) {
-        // kernel pages are read-only from user mode
-        alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
-        i += 0x1000;
+    // kernel pages are not accessible from user mode
+    // they have to be writable since CR0.WP makes the kernel respect read-only pages too
+    size_t i = 0;
+    if (pse_enabled) {
+        // a handful of 4MB pages instead of a page table per 4MB, the map is rounded up to whole large pages
+        while (i < placement_address+0x1000) {
+            map_large_page(kernel_directory, i, i, 1, 1);
+            i += LARGE_PAGE_SIZE;
+        }
+    } else {
+        // the page tables created on the way come from placement memory, which moves the end of the map
+        // so keep going until a pass no longer allocates any
+        while (i < placement_address+0x1000) {
+            size_t end = (placement_address & 0xFFFFF000) + 0x1000;
+            // identity mapped in every address space, so it can stay in the TLB across task switches
+            map_range_physical(kernel_directory, i, i, end - i, MAP_WRITABLE | MAP_GLOBAL);
+            i = end;
+        }
     }
 
-    // now we can allocate frames for pages in heap address space
-    for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += 0x1000) {
-        alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
+    identity_slots = (i + 0x3FFFFF) / 0x400000;
+
+    // placement_address can no longer move, so the identity map is off limits
+    // and every usable region left over is handed to the allocator in one go
+    memmap_reserve(0, i);
+    size_t r;
+    for (r = 0; r < memmap_region_count(); r++) {
+        mem_region_t *region = memmap_region(r);
+        buddy_free_range(region->start / 0x1000, region->end / 0x1000);
     }
 
+    // the whole range the kernel heap may grow into is committed on demand
+    // same permissions as the heap created below (not supervisor only, not read-only)
+    vm_region_add(KHEAP_START, KHEAP_MAX, VM_HEAP, VM_WRITABLE);
+
+    if (pse_enabled) {
+        // the first 4MB of the heap, where all the hot allocations live, is backed by a single large page up front
+        // if no 4MB block is free it gets a page table like the rest of the heap and is demand paged as usual
+        size_t frame = buddy_alloc(BUDDY_MAX_ORDER);
+        if (frame != BUDDY_NONE)
+            map_large_page(kernel_directory, KHEAP_START, frame * 0x1000, 0, 1);
+        else
+            map_range(kernel_directory, KHEAP_START, LARGE_PAGE_SIZE, MAP_TABLES_ONLY);
+
+        size_t cr4;
+        asm volatile("mov %%cr4, %0": "=r"(cr4));
+        cr4 |= 0x00000010; // page size extension: directory entries with the large bit map 4MB
+        asm volatile("mov %0, %%cr4":: "r"(cr4));
+    }
+
+    // kernel mappings marked global are kept by the CR3 reload in switch_task()
+    tlb_enable_global();
+
     // register for page fault interrupt
     register_interrupt_handler(14, page_fault);
 
@@ -128,50 +474,116 @@ void initialise_paging() {
     switch_page_directory(kernel_directory);
 
     // we are ready to create the kernel heap
-    kheap = create_heap(KHEAP_START, KHEAP_START+KHEAP_INITIAL_SIZE, 0xCFFFF000, 0, 0);
+    kheap = create_heap(KHEAP_START, KHEAP_START+KHEAP_INITIAL_SIZE, KHEAP_MAX, 0, 0);
 
     // current_directory = clone_directory(kernel_directory);  
     
     // switch_page_directory(current_directory); 
 }
 
+size_t page_directory_physical(page_directory_t *dir) {
+    return dir->entries[PAGE_DIRECTORY_SELF].frame * 0x1000;
+}
+
 void switch_page_directory(page_directory_t *dir) {
     current_directory = dir;
-    asm volatile("mov %0, %%cr3":: "r"(dir->physical_address_of_tables_physical));
+    asm volatile("mov %0, %%cr3":: "r"(page_directory_physical(dir)));
     size_t cr0;
     asm volatile("mov %%cr0, %0": "=r"(cr0));
     cr0 |= 0x80000000; // enables paging
+    cr0 |= 0x00010000; // write protect: read-only pages fault in kernel mode too, needed for copy-on-write
     asm volatile("mov %0, %%cr0":: "r"(cr0));
 }
 
 page_t *get_page(size_t address, int make, page_directory_t *dir) {
-    // create index from address
-    size_t page_index = address / 0x1000;
-   // find page table that contains this page index
-    size_t table_index = page_index / 1024;
-    if (dir->tables[table_index]) {
-        // straightforward, return the page cause we have it
-        return &dir->tables[table_index]->pages[page_index%1024];
-    } else if (make) {
-        // if make is set to 1, create the page table 
-        size_t tmp;
-        dir->tables[table_index] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &tmp);
-        // zero out the 4KB block
-        memset(dir->tables[table_index], 0, 0x1000);
-        // set flags 0b0111: present, read-write, user mode accessible
-        dir->tables_physical[table_index] = tmp | 0x7;
-        // return the page via the page table
-        return &dir->tables[table_index]->pages[page_index%1024];
-    } else {
+    page_table_t *table = find_table(address, make, dir);
+    if (!table)
         return 0;
+
+    // the page would only stay reachable for as long as the table's kmap slot, which nobody would give back
+    ASSERT(!table_is_kmapped(table));
+    return &table->pages[(address / 0x1000) % 1024];
+}
+
+/**
+ * Maps a zeroed frame at a not-present address that lies inside a registered region
+ * Returns 0 if the address is not in a region (or user mode touched a kernel region), i.e. the fault is a real error
+ */
+static int demand_page(size_t address, int user_mode) {
+    vm_region_t *region = vm_region_find(address);
+    if (!region)
+        return 0;
+    if (user_mode && (region->flags & VM_KERNEL))
+        return 0;
+
+    size_t page_address = address & 0xFFFFF000;
+    page_t *page = get_page(page_address, 1, current_directory);
+
+    // the frame arrives zeroed (usually straight from the idle loop's pool), so it gets its final permissions right away
+    // (not-present entries are never cached in the TLB, so nothing needs to be flushed)
+    alloc_frame(page, region->flags & VM_KERNEL, region->flags & VM_WRITABLE, 1);
+    // the heap's page tables are linked into every directory, so its pages look the same in all of them
+    if (region->type == VM_HEAP)
+        page->global = 1;
+    return 1;
+}
+
+size_t virtual_to_physical(size_t address) {
+    page_dir_entry_t *entry = &kernel_directory->entries[address / LARGE_PAGE_SIZE];
+    if (entry->large)
+        return (entry->frame << 12) + (address & (LARGE_PAGE_SIZE-1));
+
+    page_t *page = get_page(address, 0, kernel_directory);
+    if (!page || !page->present) {
+        // touching the page makes the fault handler commit a frame for it
+        (void)*(volatile uint8*)address;
+        page = get_page(address, 0, kernel_directory);
     }
+    return (page->frame << 12) + (address & 0xFFF);
 }
 
+/**
+ * Resolves a write to a copy-on-write page by giving this address space its own copy of the frame
+ */
+static void copy_on_write(page_t *page, size_t address) {
+    size_t frame = page->frame;
+
+    // still shared: move this address space onto a private copy
+    // otherwise everyone else already made their copy, and the frame can simply be made writable again
+    if (frame_refcount(frame) > 1) {
+        size_t copy = buddy_alloc(0);
+        if (copy == BUDDY_NONE) {
+            PANIC("No free frames!");
+        }
+        copy_page_physical(frame*0x1000, copy*0x1000);
+        frame_unref(frame);
+        page->frame = copy;
+    }
+
+    page->rw = 1;
+    page->cow = 0;
+
+    // drop the stale read-only translation, right away since the faulting write is retried next
+    tlb_flush_page(address);
+}
 
 void page_fault(registers_t *regs) {
    
     size_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r" (faulting_address));
+
+    // not present: demand paged regions get their frame now
+    if (!(regs->err_code & 0x1) && demand_page(faulting_address, regs->err_code & 0x4))
+        return;
+
+    // write to a present page: copy-on-write if the page is shared
+    if ((regs->err_code & 0x3) == 0x3) {
+        page_t *page = get_page(faulting_address, 0, current_directory);
+        if (page && page->cow) {
+            copy_on_write(page, faulting_address);
+            return;
+        }
+    }
     
     int present = !(regs->err_code & 0x1);
     int rw = regs->err_code & 0x2;          
@@ -195,29 +607,43 @@ void page_fault(registers_t *regs) {
 
 /**
  * Used when cloning a directory. Each table (and their pages/frames) need to cloned.
+ * User pages are shared copy-on-write, kernel pages are copied immediately.
+ * Returns the physical address of the new table.
  */
-static page_table_t *clone_table(page_table_t *src, size_t *physical_address) {
+static size_t clone_table(page_table_t *src, size_t base, int live) {
     // create a new blank page table
-    page_table_t *table = (page_table_t*) kmalloc_ap(sizeof(page_table_t), physical_address);
-    memset(table, 0, sizeof(page_directory_t));
+    size_t physical_address = pt_alloc_table();
+    page_table_t *table = (page_table_t*)kmap(physical_address);
 
     for (int i = 0; i < 1024; i++) {
-        if (src->pages[i].frame) {
+        if (src->pages[i].frame && src->pages[i].user) {
+            page_t *page = &src->pages[i];
+
+            // both sides lose write access until one of them writes and gets its own copy
+            if (page->rw) {
+                page->rw = 0;
+                page->cow = 1;
+                // src may be the directory we are running on, its writable translation is then cached
+                if (live)
+                    tlb_invalidate(base + i*0x1000);
+            }
+            table->pages[i] = *page;
+            frame_ref(page->frame);
+        } else if (src->pages[i].frame) {
 
-            alloc_frame(&table->pages[i], 0, 0);
+            // kernel page with the same permissions, backed by a new frame
+            alloc_frame(&table->pages[i], 1, src->pages[i].rw, 0);
     
-            if (src->pages[i].present) table->pages[i].present = 1;
-            if (src->pages[i].rw) table->pages[i].rw = 1;
-            if (src->pages[i].user) table->pages[i].user = 1;
             if (src->pages[i].accessed) table->pages[i].accessed = 1;
             if (src->pages[i].dirty) table->pages[i].dirty = 1;
-            // copy_page_physical lives in process.s
-            // responsible for physically copying contents of one frame into another
-            // NOTE: this involves disabling paging
+            // copy_page_physical lives in kmap.c
+            // maps both frames into the temporary window and copies them with paging on
             copy_page_physical(src->pages[i].frame*0x1000, table->pages[i].frame*0x1000);
         }
     }
-    return table;
+
+    kunmap(table);
+    return physical_address;
 }
 
 /**
@@ -228,30 +654,49 @@ static page_table_t *clone_table(page_table_t *src, size_t *physical_address) {
 page_directory_t *clone_directory(page_directory_t *src) {
     size_t physical_address;
     
-    // create a new blank page directory
-    page_directory_t *dir = (page_directory_t*) kmalloc_ap(sizeof(page_directory_t), &physical_address);
-    memset(dir, 0, sizeof(page_directory_t));
+    // create a new blank page directory, a single page that is loaded into CR3 as is
+    page_directory_t *dir = pt_alloc_directory(&physical_address);
+    set_self_entry(dir, physical_address);
 
-    // now that a new page directory has been created, we need to set the physical address of the tables_physical member
-    // this is needed to properly load the CR3 register
-    size_t offset = (size_t)dir->tables_physical - (size_t)dir;
-    dir->physical_address_of_tables_physical = physical_address + offset;
+    // pages of src that become read-only are invalidated together at the end
+    int live = (src == current_directory);
+    tlb_batch_begin();
 
-    // copy/link depending on the page table
-    for (int i = 0; i < 1024; i++) {
-        if (!src->tables[i])
+    // the kernel part is the same fixed set of entries in every directory, a plain copy links it
+    link_kernel_slots(dir);
+
+    // the rest is private to src, the self referencing slot was set above
+    for (int i = 0; i < PAGE_DIRECTORY_SELF; i++) {
+        page_dir_entry_t *entry = &src->entries[i];
+
+        if (is_kernel_slot(i) || !entry->present)
             continue;
 
-        // check if the page table is in the kernel directory
-        if (kernel_directory->tables[i] == src->tables[i]) {
-            // link to the kernel page table
-            dir->tables[i] = src->tables[i];
-            dir->tables_physical[i] = src->tables_physical[i];
-        } else {
-            // create a copy since it will be potentially modified
-            dir->tables[i] = clone_table(src->tables[i], &physical_address);
-            dir->tables_physical[i] = physical_address | 0x07;
-        }
+        // create a copy since it will be potentially modified
+        page_table_t *src_table = page_table(src, i);
+        size_t table = clone_table(src_table, i*0x400000, live);
+        release_table(src_table);
+        set_table_entry(&dir->entries[i], table);
     }
+
+    tlb_batch_end();
     return dir;
-}
\ No newline at end of file
+}
+
+void free_directory(page_directory_t *dir) {
+    ASSERT(dir != kernel_directory && dir != current_directory);
+
+    for (int i = 0; i < PAGE_DIRECTORY_SELF; i++) {
+        page_dir_entry_t *entry = &dir->entries[i];
+
+        // linked kernel tables belong to the kernel directory
+        if (is_kernel_slot(i) || !entry->present)
+            continue;
+
+        // dir is not active, so none of this is cached and unmap_range invalidates nothing
+        unmap_range(dir, i*0x400000, 0x400000);
+        pt_free_table(entry->frame * 0x1000);
+    }
+
+    pt_free_directory(dir);
+}
@@ -14,26 +14,63 @@
  */
 
 typedef struct page {
-    size_t present    : 1; // page present in memory
-    size_t rw         : 1; // read-only if clear, read-write if set
-    size_t user       : 1; // kernel mode if clear
-    size_t accessed   : 1; // accessed since last refresh
-    size_t dirty      : 1; // written to since last refresh
-    size_t unused     : 7; // unused/reserved bits
-    size_t frame      : 20; // frame address (shifted right 12 bits)
+    size_t present       : 1; // page present in memory
+    size_t rw            : 1; // read-only if clear, read-write if set
+    size_t user          : 1; // kernel mode if clear
+    size_t write_through : 1; // write-through caching if set
+    size_t cache_disable : 1; // not cached if set
+    size_t accessed      : 1; // accessed since last refresh
+    size_t dirty         : 1; // written to since last refresh
+    size_t pat           : 1; // page attribute table index, unused
+    size_t global        : 1; // not flushed from the TLB on CR3 reload (needs CR4.PGE)
+    size_t cow           : 1; // available to the OS: read-only because the frame is shared copy-on-write
+    size_t unused        : 2; // available to the OS
+    size_t frame         : 20; // frame address (shifted right 12 bits)
 } page_t;
 
 typedef struct page_table {
     page_t pages[1024];
 } page_table_t;
 
-typedef struct page_directory {
+// a large page maps the whole 4MB a page directory entry covers (needs CR4.PSE)
+#define LARGE_PAGE_SIZE 0x400000
+
+/**
+ * Page directory entry, as seen by the MMU
+ * Normally it points to a page table. With the large bit set it maps a 4MB aligned block of frames directly,
+ * frame then holds the physical address of that block and no page table is involved.
+ */
+typedef struct page_dir_entry {
+    size_t present       : 1;
+    size_t rw            : 1;
+    size_t user          : 1;
+    size_t write_through : 1;
+    size_t cache_disable : 1;
+    size_t accessed      : 1;
+    size_t dirty         : 1; // large pages only
+    size_t large         : 1; // 4MB page instead of a page table
+    size_t global        : 1; // large pages only
+    size_t unused        : 3; // available to the OS
+    size_t frame         : 20; // page table address, or large page address (shifted right 12 bits)
+} page_dir_entry_t;
+
+/**
+ * Recursive mapping
+ * The last directory slot points at the directory itself, so the MMU treats the directory as the page table for the
+ * top 4MB of every address space. The page tables of the active directory then show up as a fixed array of pages at
+ * PAGE_TABLES_VIRTUAL (table i at PAGE_TABLES_VIRTUAL + i*0x1000), and a page_t is found by a plain address computation.
+ * Page tables of a directory that is not active are reached through a kmap slot.
+ */
+#define PAGE_DIRECTORY_SELF 1023
+#define PAGE_TABLES_VIRTUAL 0xFFC00000
 
-    page_table_t *tables[1024];
-    // physical addresses of page tables, useful for loading into CR3 register
-    size_t tables_physical[1024];
-    // useful once paging is enabled and the directory may be in a different location in virtual memory
-    size_t physical_address_of_tables_physical;
+/**
+ * A directory is exactly the 4KB frame the MMU walks, nothing else
+ * Large and small mappings live side by side: an entry either points at a page table or has the large bit set.
+ * Its own physical address is kept in the self referencing entry, see page_directory_physical().
+ */
+typedef struct page_directory {
+    page_dir_entry_t entries[1024];
 } page_directory_t;
 
 /**
@@ -46,21 +83,95 @@ void initialise_paging();
  */
 void switch_page_directory(page_directory_t *new);
 
+// the value CR3 has to hold for dir
+size_t page_directory_physical(page_directory_t *dir);
+
 /**
  * Retrieve page for address
  * If make == 1, create page if it does not already exist
+ * Returns 0 for addresses mapped by a large page, those have no page_t
+ * dir must be the active directory or share the page table with it (e.g. kernel tables), pages of other directories are
+ * only reached by map_range/unmap_range/unmap_page/clone_directory, which map each table through a kmap slot while they use it
  */
 page_t *get_page(size_t address, int make, page_directory_t *dir);
 
+/**
+ * Returns the physical address behind a kernel virtual address
+ * A page in a demand paged region that has not been touched yet is committed first
+ */
+size_t virtual_to_physical(size_t address);
+
 /**
  * Handler for page faults
+ * Not-present faults inside a registered vm_region are resolved by mapping a zeroed frame (demand paging),
+ * write faults on copy-on-write pages by copying the frame. Anything else is a bug and panics.
  */
 void page_fault(registers_t *regs);
 
+/**
+ * Creates a new address space from src
+ * The kernel part (identity map, kernel heap, kmap and directory windows) is linked, its page tables all exist from boot on.
+ * Every other page table is copied.
+ * User pages are not copied: both directories map the same frame read-only and a write fault makes the private copy (copy-on-write).
+ * Kernel pages are copied right away, since the kernel has to be able to write them (e.g. its stack) at any time.
+ */
 page_directory_t *clone_directory(page_directory_t *src);
 
-void alloc_frame(page_t *page, int is_kernel, int is_writeable);
+/**
+ * Tears down an address space created by clone_directory
+ * Frees the frames of every page that is not shared with the kernel directory, the page tables holding them and the
+ * directory itself. dir must not be active.
+ */
+void free_directory(page_directory_t *dir);
+
+/**
+ * Backs page with a frame, unless it already has one
+ * With is_zeroed set the frame is guaranteed to be zero filled, it then comes from the pre-zeroed pool when possible
+ */
+void alloc_frame(page_t *page, int is_kernel, int is_writeable, int is_zeroed);
 
 void free_frame(page_t *page);
 
+// flags for map_range()
+#define MAP_WRITABLE    0x1
+#define MAP_USER        0x2 // accessible from user mode
+#define MAP_GLOBAL      0x4 // kept in the TLB across CR3 reloads, only for mappings every address space shares
+#define MAP_ZERO        0x8 // the frames are zero filled
+#define MAP_TABLES_ONLY 0x10 // only create the page tables, the frames are committed later (demand paging)
+
+/**
+ * Maps [vaddr, vaddr+len) in dir, rounded out to whole pages
+ * Frames are taken from the buddy allocator in blocks as large as the rest of each page table, and every page table is
+ * walked once. Pages that already have a frame (or lie in a large page) are left alone.
+ * Only not-present entries change, and those are never cached, so no TLB invalidation is needed.
+ */
+void map_range(page_directory_t *dir, size_t vaddr, size_t len, size_t flags);
+
+/**
+ * Same as map_range, but maps the range onto the physical range starting at paddr instead of allocating frames
+ * (e.g. the identity map). The frames are not owned by the allocator.
+ */
+void map_range_physical(page_directory_t *dir, size_t vaddr, size_t paddr, size_t len, size_t flags);
+
+/**
+ * Frees the frames behind [vaddr, vaddr+len) in dir
+ * Pages that may be cached are invalidated in one batch at the end
+ */
+void unmap_range(page_directory_t *dir, size_t vaddr, size_t len);
+
+/**
+ * Frees the frame behind address in dir and invalidates its TLB entry if the mapping may be cached
+ * Wrap loops in tlb_batch_begin()/tlb_batch_end() to invalidate them together
+ */
+void unmap_page(size_t address, page_directory_t *dir);
+
+/**
+ * Allocates 2^order physically contiguous frames and returns the physical address of the first one
+ * Useful for DMA buffers or anything else that needs more than one frame in a row
+ */
+size_t alloc_frames(size_t order);
+
+// returns frames from alloc_frames, order must match
+void free_frames(size_t address, size_t order);
+
 #endif
@@ -0,0 +1,163 @@
+#include "pt_pool.h"
+#include "paging.h"
+#include "buddy.h"
+#include "kmap.h"
+#include "tlb.h"
+#include "zero_pool.h"
+#include "../process/sync.h"
+#include "../screen/monitor.h"
+#include "../tools.h"
+
+extern page_directory_t *kernel_directory;
+
+// freed page tables, linked through their first word (a physical address), BUDDY_NONE ends the list
+static size_t free_tables = BUDDY_NONE;
+static size_t free_table_count = 0;
+static size_t active_tables = 0;
+
+// page table entries of the directory window, slot i maps PT_DIR_WINDOW + i*0x1000
+static page_t *dir_slots;
+// freed directories, linked through their first word (a virtual address)
+static page_directory_t *free_dirs = 0;
+static size_t free_dir_count = 0;
+// slots past this one never had a frame
+static size_t next_dir_slot = 0;
+// slots below next_dir_slot whose frame went back to the allocator
+static uint16 bare_slots[PT_DIR_SLOTS];
+static size_t bare_slot_count = 0;
+
+// fork and the reaper both come through here, and a page fault can create a page table
+static spinlock_t pt_lock;
+
+static size_t take_frame() {
+    size_t frame = zero_pool_alloc();
+    if (frame == BUDDY_NONE) {
+        PANIC("No free frames!");
+    }
+    return frame;
+}
+
+void pt_pool_init() {
+    spin_lock_init(&pt_lock, "pt_pool");
+    dir_slots = get_page(PT_DIR_WINDOW, 1, kernel_directory);
+}
+
+size_t pt_alloc_table() {
+    size_t flags = spin_lock_irqsave(&pt_lock);
+    active_tables++;
+
+    if (free_tables == BUDDY_NONE) {
+        spin_unlock_irqrestore(&pt_lock, flags);
+        return take_frame() * 0x1000;
+    }
+
+    size_t table = free_tables;
+    size_t *mapped = (size_t*)kmap(table);
+    free_tables = *mapped;
+    free_table_count--;
+    spin_unlock_irqrestore(&pt_lock, flags);
+
+    // zeroed now rather than when it was freed, a table that is never reused costs nothing
+    zero_page(mapped);
+    kunmap(mapped);
+    return table;
+}
+
+void pt_free_table(size_t physical) {
+    size_t flags = spin_lock_irqsave(&pt_lock);
+    ASSERT(active_tables > 0);
+    active_tables--;
+
+    // enough is kept for the next burst of forks, the rest goes back to the allocator
+    if (free_table_count >= PT_FREE_TABLES_MAX) {
+        spin_unlock_irqrestore(&pt_lock, flags);
+        buddy_free(physical / 0x1000, 0);
+        return;
+    }
+
+    size_t *mapped = (size_t*)kmap(physical);
+    *mapped = free_tables;
+    kunmap(mapped);
+    free_tables = physical;
+    free_table_count++;
+
+    spin_unlock_irqrestore(&pt_lock, flags);
+}
+
+page_directory_t *pt_alloc_directory(size_t *physical) {
+    page_directory_t *dir;
+    size_t flags = spin_lock_irqsave(&pt_lock);
+
+    if (free_dirs) {
+        dir = free_dirs;
+        free_dirs = *(page_directory_t**)dir;
+        free_dir_count--;
+        spin_unlock_irqrestore(&pt_lock, flags);
+        zero_page(dir);
+    } else {
+        // a slot that gave its frame back, or one that never had any
+        size_t slot;
+        if (bare_slot_count) {
+            slot = bare_slots[--bare_slot_count];
+        } else {
+            if (next_dir_slot == PT_DIR_SLOTS) {
+                PANIC("No free page directory slots!");
+            }
+            slot = next_dir_slot++;
+        }
+        // the slot is ours from here on, nobody else looks at it until it is freed
+        spin_unlock_irqrestore(&pt_lock, flags);
+
+        // the slot is not mapped (pt_free_directory flushed it if it ever was), so it cannot be cached in the TLB
+        page_t *page = &dir_slots[slot];
+        page->present = 1;
+        page->rw = 1;
+        page->user = 0;
+        // the window is the same in every address space
+        page->global = 1;
+        page->frame = take_frame();
+        dir = (page_directory_t*)(PT_DIR_WINDOW + slot*0x1000);
+    }
+
+    // a slot keeps its frame for as long as it holds a directory, so the mapping tells us where the directory lives
+    *physical = dir_slots[((size_t)dir - PT_DIR_WINDOW) / 0x1000].frame * 0x1000;
+    return dir;
+}
+
+void pt_free_directory(page_directory_t *dir) {
+    size_t flags = spin_lock_irqsave(&pt_lock);
+    ASSERT((size_t)dir >= PT_DIR_WINDOW && (size_t)dir < PT_DIR_WINDOW + next_dir_slot*0x1000);
+
+    if (free_dir_count >= PT_FREE_DIRS_MAX) {
+        // the frame goes back to the allocator, the slot stays in the window and gets a new frame when it is reused
+        size_t slot = ((size_t)dir - PT_DIR_WINDOW) / 0x1000;
+        page_t *page = &dir_slots[slot];
+        size_t frame = page->frame;
+        page->present = 0;
+        page->frame = 0;
+        // global, a CR3 reload would keep it
+        tlb_flush_page((size_t)dir);
+        bare_slots[bare_slot_count++] = slot;
+
+        spin_unlock_irqrestore(&pt_lock, flags);
+        buddy_free(frame, 0);
+        return;
+    }
+
+    *(page_directory_t**)dir = free_dirs;
+    free_dirs = dir;
+    free_dir_count++;
+    spin_unlock_irqrestore(&pt_lock, flags);
+}
+
+void pt_pool_print_stats() {
+    monitor_write("page tables: ");
+    monitor_write_dec(active_tables);
+    monitor_write(" in use, ");
+    monitor_write_dec(free_table_count);
+    monitor_write(" free\npage directories: ");
+    monitor_write_dec(next_dir_slot - free_dir_count - bare_slot_count);
+    monitor_write(" in use, ");
+    monitor_write_dec(free_dir_count);
+    monitor_write(" free\n");
+}
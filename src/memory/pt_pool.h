@@ -0,0 +1,43 @@
+#ifndef PT_POOL_H
+#define PT_POOL_H
+
+#include "../tools.h"
+#include "paging.h"
+
+/**
+ * Pool for paging structures (page tables and page directories)
+ * They are page sized, page aligned and churn with every fork/exit, so they do not go through the kernel heap.
+ * Both are plain frames: freed ones go onto a free list and are only zeroed again when they are handed out (lazy zeroing),
+ * a new frame comes from the zeroed frame pool. The free lists are behind an irq-safe spinlock.
+ * Each free list keeps at most PT_FREE_*_MAX entries, anything freed beyond that goes back to the buddy allocator
+ * so a burst of forks does not pin its peak page table footprint for good.
+ *
+ * Page tables are only ever reached by their physical address (recursive mapping or kmap).
+ * Directories also need a kernel virtual address, since the kernel keeps page_directory_t pointers, so each one gets a
+ * slot in a window at PT_DIR_WINDOW whose page table every address space shares.
+ */
+
+// slot below the kmap window
+#define PT_DIR_WINDOW 0xFF400000
+#define PT_DIR_SLOTS  1024
+
+// freed page tables and directories kept for reuse
+#define PT_FREE_TABLES_MAX 64
+#define PT_FREE_DIRS_MAX   16
+
+// creates the directory window's page table, must run before the identity map is set up
+void pt_pool_init();
+
+// returns the physical address of a zeroed page table
+size_t pt_alloc_table();
+
+void pt_free_table(size_t physical);
+
+// returns a zeroed directory and its physical address
+page_directory_t *pt_alloc_directory(size_t *physical);
+
+void pt_free_directory(page_directory_t *dir);
+
+void pt_pool_print_stats();
+
+#endif
@@ -0,0 +1,105 @@
+#include "slab.h"
+#include "kheap.h"
+#include "paging.h"
+#include "../tools.h"
+
+#define PAGE_SIZE 0x1000
+
+extern heap_t *kheap;
+
+/**
+ * Gets a new slab from the heap. Slabs are page aligned, which covers any alignment up to a page
+ */
+static void grow(kmem_cache_t *cache) {
+    ASSERT(cache->align <= PAGE_SIZE);
+
+    size_t slab = kmalloc_a(cache->slab_size);
+    cache->fresh = slab;
+    cache->fresh_end = slab + cache->slab_size;
+}
+
+kmem_cache_t *kmem_cache_create(char *name, size_t size, size_t align, kmem_ctor_t ctor) {
+    kmem_cache_t *cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+
+    if (align == 0)
+        align = sizeof(size_t);
+
+    // a free object stores the free list link in its first word
+    if (size < sizeof(void*))
+        size = sizeof(void*);
+
+    // round up so that every object in a slab keeps the alignment of the first one
+    size = (size + align - 1) & ~(align - 1);
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->free_list = 0;
+    cache->fresh = cache->fresh_end = 0;
+    cache->total_objects = cache->active_objects = 0;
+    spin_lock_init(&cache->lock, name);
+
+    if (size >= PAGE_SIZE)
+        cache->slab_size = size * KMEM_LARGE_SLAB_OBJECTS;
+    else
+        cache->slab_size = PAGE_SIZE;
+
+    // take the first slab right away, so a cache created before paging is enabled
+    // gets its memory from placement memory that will be identity mapped
+    grow(cache);
+
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    void *obj;
+    size_t flags = spin_lock_irqsave(&cache->lock);
+
+    if (cache->free_list) {
+        // reuse the most recently freed object
+        obj = cache->free_list;
+        cache->free_list = *(void**)obj;
+    } else {
+        if (cache->fresh + cache->object_size > cache->fresh_end)
+            grow(cache);
+
+        obj = (void*)cache->fresh;
+        cache->fresh += cache->object_size;
+        cache->total_objects++;
+    }
+
+    cache->active_objects++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (cache->ctor)
+        cache->ctor(obj);
+
+    return obj;
+}
+
+void *kmem_cache_alloc_p(kmem_cache_t *cache, size_t *phys) {
+    void *obj = kmem_cache_alloc(cache);
+
+    if (kheap == 0) {
+        // paging is not enabled yet, slabs come from placement memory which will be identity mapped
+        *phys = (size_t)obj;
+    } else {
+        *phys = virtual_to_physical((size_t)obj);
+    }
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (obj == 0)
+        return;
+
+    size_t flags = spin_lock_irqsave(&cache->lock);
+    ASSERT(cache->active_objects > 0);
+
+    *(void**)obj = cache->free_list;
+    cache->free_list = obj;
+    cache->active_objects--;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
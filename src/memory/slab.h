@@ -0,0 +1,51 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "../tools.h"
+#include "../process/sync.h"
+
+/**
+ * Object caches for fixed-size kernel structures (tasks, filesystem nodes, page tables, ...)
+ * Every kmalloc pays for a header_t, a footer_t and a search through the heap. Structures that are allocated over and over
+ * with the same size can instead come from a cache: the cache grabs a whole slab (one or more pages) from the heap at once
+ * and hands out objects from it with no per-object header.
+ *
+ * Freed objects go onto a per-cache free list (linked through their first word) and are handed out again first,
+ * so both kmem_cache_alloc and kmem_cache_free are O(1). Slabs are never given back to the heap.
+ * Each cache has its own irq-safe spinlock, the #NM handler allocates FPU save areas from one.
+ */
+
+// objects of at least a page get slabs holding this many objects, smaller objects get a single page
+#define KMEM_LARGE_SLAB_OBJECTS 4
+
+// called on every object handed out by kmem_cache_alloc, so it always starts in a known state
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_cache {
+    char *name;
+    size_t object_size; // size of each object, rounded up to the alignment
+    size_t align;
+    size_t slab_size; // bytes requested from the heap each time the cache grows
+    kmem_ctor_t ctor;
+    void *free_list; // freed objects ready for reuse
+    size_t fresh; // next never-used object in the newest slab
+    size_t fresh_end; // end of the newest slab
+    size_t total_objects; // objects carved out of slabs so far
+    size_t active_objects; // objects currently handed out
+    spinlock_t lock; // protects everything above but the settings fixed at creation
+} kmem_cache_t;
+
+/**
+ * Creates a cache of objects of the given size
+ * align must be a power of two (0 means word aligned), ctor may be 0
+ */
+kmem_cache_t *kmem_cache_create(char *name, size_t size, size_t align, kmem_ctor_t ctor);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+// same as kmem_cache_alloc, but also returns the physical address of the object (used for paging structures)
+void *kmem_cache_alloc_p(kmem_cache_t *cache, size_t *phys);
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+#endif
@@ -0,0 +1,115 @@
+#include "tlb.h"
+#include "../tools.h"
+
+// pages waiting to be invalidated by the open batch
+static size_t pending[TLB_FLUSH_THRESHOLD];
+static size_t pending_count = 0;
+// set once the batch has too many pages to track, the batch then ends with a full flush
+static uint8 pending_full = 0;
+static size_t batch_depth = 0;
+// EFLAGS from before the outermost batch turned interrupts off
+static size_t batch_eflags;
+static int global_enabled = 0;
+
+void tlb_flush_page(size_t address) {
+    asm volatile("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+static void write_cr4_pge(int enabled) {
+    size_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    if (enabled)
+        cr4 |= 0x00000080;
+    else
+        cr4 &= ~0x00000080;
+    asm volatile("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+int tlb_enable_global() {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & 0x2000)) // bit 13: page global enable
+        return 0;
+
+    write_cr4_pge(1);
+    global_enabled = 1;
+    return 1;
+}
+
+void tlb_disable_global() {
+    write_cr4_pge(0);
+    global_enabled = 0;
+}
+
+void tlb_flush_all() {
+    // a CR3 reload keeps global entries, toggling CR4.PGE drops everything
+    if (global_enabled) {
+        write_cr4_pge(0);
+        write_cr4_pge(1);
+        return;
+    }
+
+    size_t pd_addr;
+    asm volatile("mov %%cr3, %0" : "=r" (pd_addr));
+    asm volatile("mov %0, %%cr3" : : "r" (pd_addr) : "memory");
+}
+
+void tlb_invalidate(size_t address) {
+    if (batch_depth == 0) {
+        tlb_flush_page(address);
+        return;
+    }
+
+    if (pending_full)
+        return;
+
+    if (pending_count == TLB_FLUSH_THRESHOLD) {
+        pending_full = 1;
+        return;
+    }
+
+    pending[pending_count++] = address & 0xFFFFF000;
+}
+
+void tlb_invalidate_range(size_t start, size_t end) {
+    start &= 0xFFFFF000;
+
+    if ((end - start) / 0x1000 > TLB_FLUSH_THRESHOLD) {
+        if (batch_depth == 0)
+            tlb_flush_all();
+        else
+            pending_full = 1;
+        return;
+    }
+
+    for (; start < end; start += 0x1000)
+        tlb_invalidate(start);
+}
+
+void tlb_batch_begin() {
+    // an interrupt handler or another task would otherwise have its invalidations queued behind ours
+    // and run on the stale entries until the batch ends
+    size_t eflags = irq_save();
+    if (batch_depth++ == 0)
+        batch_eflags = eflags;
+}
+
+void tlb_batch_end() {
+    ASSERT(batch_depth > 0);
+
+    if (--batch_depth != 0)
+        return;
+
+    if (pending_full) {
+        tlb_flush_all();
+    } else {
+        size_t i;
+        for (i = 0; i < pending_count; i++)
+            tlb_flush_page(pending[i]);
+    }
+
+    pending_count = 0;
+    pending_full = 0;
+
+    irq_restore(batch_eflags);
+}
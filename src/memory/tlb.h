@@ -0,0 +1,49 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include "../tools.h"
+
+/**
+ * Translation Lookaside Buffer (TLB) management
+ * The CPU caches page table entries in the TLB, so after a present mapping is changed or removed the old translation
+ * has to be invalidated. Reloading CR3 throws away the whole TLB, invlpg drops the entry for a single page.
+ *
+ * Changes that touch many pages can be batched: between tlb_batch_begin() and tlb_batch_end() calls to tlb_invalidate()
+ * are only recorded, and the batch is flushed at the end with one invlpg per page, or a single CR3 reload once more
+ * than TLB_FLUSH_THRESHOLD pages are involved.
+ *
+ * Entries for pages that were not present are never cached, so mapping a new page needs no invalidation.
+ */
+
+// above this many pages a full flush is cheaper than invalidating them one by one
+#define TLB_FLUSH_THRESHOLD 32
+
+// invalidates a single page right away, even inside a batch (used by the page fault handler)
+void tlb_flush_page(size_t address);
+
+// invalidates every TLB entry, global ones included
+void tlb_flush_all();
+
+/**
+ * Global pages (CR4.PGE)
+ * Entries marked global survive CR3 reloads, so the kernel mappings every address space shares
+ * do not have to be refilled after each task switch. Returns 0 if the CPU has no global page support.
+ */
+int tlb_enable_global();
+void tlb_disable_global();
+
+// invalidates the page now, or records it if a batch is open
+void tlb_invalidate(size_t address);
+
+// invalidates every page in [start, end), falling back to a full flush above the threshold
+void tlb_invalidate_range(size_t start, size_t end);
+
+/**
+ * Batches can be nested, the pending invalidations are flushed when the outermost one ends
+ * Interrupts are off for the whole batch: the pending list is global, so only the code that opened the batch may add to it
+ * (and nothing inside it may block)
+ */
+void tlb_batch_begin();
+void tlb_batch_end();
+
+#endif
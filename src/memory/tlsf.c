@@ -0,0 +1,261 @@
+#include "tlsf.h"
+#include "kheap.h"
+#include "../tools.h"
+
+#define PAGE_SIZE 0x1000
+
+#define TLSF_LINKS(h) ((tlsf_links_t *) ((size_t)(h) + sizeof(header_t)))
+#define TLSF_FOOTER(h) ((footer_t *) ((size_t)(h) + (h)->size - sizeof(footer_t)))
+
+// index of the most significant set bit, word must not be 0
+static inline int32 tlsf_fls(size_t word) {
+    int32 bit;
+    asm("bsr %1, %0" : "=r"(bit) : "rm"(word));
+    return bit;
+}
+
+// index of the least significant set bit, word must not be 0
+static inline int32 tlsf_ffs(size_t word) {
+    int32 bit;
+    asm("bsf %1, %0" : "=r"(bit) : "rm"(word));
+    return bit;
+}
+
+/**
+ * Maps a block size onto the free list that holds blocks of that size
+ * Sizes below TLSF_SMALL_BLOCK all live in first level 0, split linearly
+ */
+static void mapping_insert(size_t size, int32 *fl, int32 *sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+    } else {
+        int32 bit = tlsf_fls(size);
+        *sl = (size >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = bit - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+/**
+ * Same as mapping_insert, but rounds the size up to the next list first
+ * so that any block found in the resulting list is guaranteed to be big enough
+ */
+static void mapping_search(size_t size, int32 *fl, int32 *sl) {
+    if (size >= TLSF_SMALL_BLOCK)
+        size += (1 << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+// header + payload + footer, rounded so that every block keeps 4 byte alignment
+static size_t adjust_size(size_t size) {
+    size_t block_size = ((size + 3) & ~3) + sizeof(header_t) + sizeof(footer_t);
+    if (block_size < TLSF_MIN_BLOCK)
+        block_size = TLSF_MIN_BLOCK;
+    return block_size;
+}
+
+static void set_block(header_t *header, size_t size, uint8 is_hole) {
+    header->magic = HEAP_MAGIC;
+    header->is_hole = is_hole;
+    header->size = size;
+
+    footer_t *footer = TLSF_FOOTER(header);
+    footer->magic = HEAP_MAGIC;
+    footer->header = header;
+}
+
+static void insert_block(header_t *block, tlsf_control_t *control) {
+    int32 fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+
+    header_t *head = control->blocks[fl][sl];
+    TLSF_LINKS(block)->next = head;
+    TLSF_LINKS(block)->prev = 0;
+    if (head)
+        TLSF_LINKS(head)->prev = block;
+
+    control->blocks[fl][sl] = block;
+    control->fl_bitmap |= (1 << fl);
+    control->sl_bitmap[fl] |= (1 << sl);
+}
+
+static void remove_block(header_t *block, tlsf_control_t *control) {
+    int32 fl, sl;
+    mapping_insert(block->size, &fl, &sl);
+
+    header_t *next = TLSF_LINKS(block)->next;
+    header_t *prev = TLSF_LINKS(block)->prev;
+    if (next)
+        TLSF_LINKS(next)->prev = prev;
+    if (prev)
+        TLSF_LINKS(prev)->next = next;
+
+    if (control->blocks[fl][sl] == block) {
+        control->blocks[fl][sl] = next;
+        // list is now empty, clear its bits so searches skip it
+        if (!next) {
+            control->sl_bitmap[fl] &= ~(1 << sl);
+            if (!control->sl_bitmap[fl])
+                control->fl_bitmap &= ~(1 << fl);
+        }
+    }
+}
+
+/**
+ * Finds a hole of at least size bytes using only the two bitmaps, returns 0 if there is none
+ */
+static header_t *locate_block(size_t size, tlsf_control_t *control) {
+    int32 fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+        return 0;
+
+    // any non-empty list in the same first level that is at least as big
+    size_t sl_map = control->sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map) {
+        // otherwise the smallest non-empty list in a bigger first level
+        size_t fl_map = (fl + 1 < 32) ? control->fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (!fl_map)
+            return 0;
+        fl = tlsf_ffs(fl_map);
+        sl_map = control->sl_bitmap[fl];
+    }
+    sl = tlsf_ffs(sl_map);
+    return control->blocks[fl][sl];
+}
+
+/**
+ * Grows the heap so that a hole of at least size bytes exists at its end
+ * If the last block is already a hole it is extended rather than leaving two neighbouring holes
+ */
+static void grow(size_t size, heap_t *heap) {
+    size_t old_length = heap->end_address - heap->start_address;
+    header_t *block = (header_t *)heap->end_address;
+
+    if (heap->end_address > heap->start_address) {
+        footer_t *last_footer = (footer_t *) (heap->end_address - sizeof(footer_t));
+        if (last_footer->magic == HEAP_MAGIC && last_footer->header->is_hole) {
+            block = last_footer->header;
+            remove_block(block, heap->tlsf);
+        }
+    }
+
+    // leave room for mapping_search rounding the request up to the next list
+    size += (size >> TLSF_SL_LOG2) + sizeof(size_t);
+
+    size_t new_length = (size_t)block + size - heap->start_address;
+    if (new_length <= old_length)
+        new_length = old_length + PAGE_SIZE;
+    expand(new_length, heap);
+
+    set_block(block, heap->end_address - (size_t)block, 1);
+    insert_block(block, heap->tlsf);
+}
+
+void tlsf_init(heap_t *heap, size_t start, size_t end) {
+    tlsf_control_t *control = (tlsf_control_t *)start;
+    memset((uint8 *)control, 0, sizeof(tlsf_control_t));
+
+    // blocks start after the control structure on a page boundary
+    start += sizeof(tlsf_control_t);
+    if ((start & 0x00000FFF) != 0) {
+        start &= 0xFFFFF000;
+        start += PAGE_SIZE;
+    }
+
+    heap->tlsf = control;
+    heap->start_address = start;
+    heap->end_address = end;
+
+    header_t *hole = (header_t *)start;
+    set_block(hole, end - start, 1);
+    insert_block(hole, control);
+}
+
+void *tlsf_alloc(size_t size, uint8 page_align, heap_t *heap) {
+    size_t block_size = adjust_size(size);
+
+    // a page aligned block may need to give up the front of the hole, so search for enough to cover that
+    size_t search_size = block_size;
+    if (page_align)
+        search_size += PAGE_SIZE + TLSF_MIN_BLOCK;
+
+    header_t *block = locate_block(search_size, heap->tlsf);
+    if (!block) {
+        grow(search_size, heap);
+        block = locate_block(search_size, heap->tlsf);
+        ASSERT(block != 0);
+    }
+    remove_block(block, heap->tlsf);
+
+    size_t payload = (size_t)block + sizeof(header_t);
+    if (page_align && (payload & 0x00000FFF)) {
+        // move the block forward to the next page boundary that leaves room for a hole in front of it
+        size_t aligned = ((payload + TLSF_MIN_BLOCK + 0xFFF) & 0xFFFFF000) - sizeof(header_t);
+        size_t gap = aligned - (size_t)block;
+        size_t remaining = block->size - gap;
+
+        // the block in front of a hole is never a hole, so the gap can be inserted without merging
+        set_block(block, gap, 1);
+        insert_block(block, heap->tlsf);
+
+        block = (header_t *)aligned;
+        block->size = remaining;
+    }
+
+    // split off the tail as a new hole if it is big enough to hold one
+    if (block->size - block_size >= TLSF_MIN_BLOCK) {
+        header_t *tail = (header_t *) ((size_t)block + block_size);
+        set_block(tail, block->size - block_size, 1);
+        insert_block(tail, heap->tlsf);
+        block->size = block_size;
+    }
+
+    set_block(block, block->size, 0);
+    return (void *) ((size_t)block + sizeof(header_t));
+}
+
+void tlsf_free(void *p, heap_t *heap) {
+    if (p == 0)
+        return;
+
+    header_t *header = (header_t *) ((size_t)p - sizeof(header_t));
+    footer_t *footer = TLSF_FOOTER(header);
+
+    ASSERT(header->magic == HEAP_MAGIC);
+    ASSERT(footer->magic == HEAP_MAGIC);
+    ASSERT(header->is_hole == 0);
+
+    // merge with the block in front if it is a hole
+    if ((size_t)header > heap->start_address) {
+        footer_t *prev_footer = (footer_t *) ((size_t)header - sizeof(footer_t));
+        ASSERT(prev_footer->magic == HEAP_MAGIC);
+        header_t *prev = prev_footer->header;
+        if (prev->is_hole) {
+            remove_block(prev, heap->tlsf);
+            prev->size += header->size;
+            header = prev;
+        }
+    }
+
+    // merge with the block behind if it is a hole
+    header_t *next = (header_t *) ((size_t)header + header->size);
+    if ((size_t)next < heap->end_address) {
+        ASSERT(next->magic == HEAP_MAGIC);
+        if (next->is_hole) {
+            remove_block(next, heap->tlsf);
+            header->size += next->size;
+        }
+    }
+
+    // a large hole at the end of the heap is handed back to the paging layer
+    size_t old_length = heap->end_address - heap->start_address;
+    if ((size_t)header + header->size == heap->end_address && header->size >= TLSF_CONTRACT_SIZE && old_length > HEAP_MIN_SIZE) {
+        // keep enough of the hole to still describe it
+        contract((size_t)header - heap->start_address + TLSF_MIN_BLOCK, heap);
+        header->size = heap->end_address - (size_t)header;
+    }
+
+    set_block(header, header->size, 1);
+    insert_block(header, heap->tlsf);
+}
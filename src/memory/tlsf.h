@@ -0,0 +1,51 @@
+#ifndef TLSF_H
+#define TLSF_H
+
+#include "../tools.h"
+#include "kheap.h"
+
+/**
+ * Two-Level Segregated Fit (TLSF) heap
+ * Holes are kept in segregated free lists instead of one sorted index. The first level splits sizes by power of two,
+ * the second level splits each power of two into TLSF_SL_COUNT equal ranges.
+ * A bitmap per level records which lists are non-empty, so finding a hole that fits is two bit scans (bsf) instead of a walk
+ * over every hole. Allocation and free are therefore bounded O(1) no matter how fragmented the heap gets.
+ *
+ * Blocks still use the header_t/footer_t boundary tags from kheap.h. A hole additionally stores its free list links
+ * directly after its header, which is why a block can never be smaller than TLSF_MIN_BLOCK.
+ */
+
+#define TLSF_ALIGN_LOG2  2
+#define TLSF_SL_LOG2     4
+#define TLSF_SL_COUNT    (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT    (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT    (32 - TLSF_FL_SHIFT + 1)
+
+// links for a hole's free list, stored in the payload area right after its header
+typedef struct {
+    header_t *next;
+    header_t *prev;
+} tlsf_links_t;
+
+#define TLSF_MIN_BLOCK (sizeof(header_t) + sizeof(tlsf_links_t) + sizeof(footer_t))
+
+// only give memory back to the paging layer once a hole at the end of the heap is at least this big
+#define TLSF_CONTRACT_SIZE 0x10000
+
+typedef struct tlsf_control {
+    size_t fl_bitmap; // bit n set if any list in first level n is non-empty
+    size_t sl_bitmap[TLSF_FL_COUNT]; // bit n set if list [fl][n] is non-empty
+    header_t *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT]; // heads of the segregated free lists
+} tlsf_control_t;
+
+/**
+ * Places the TLSF control structure at start and turns the rest of [start, end) into a single hole
+ */
+void tlsf_init(heap_t *heap, size_t start, size_t end);
+
+void *tlsf_alloc(size_t size, uint8 page_align, heap_t *heap);
+
+void tlsf_free(void *p, heap_t *heap);
+
+#endif
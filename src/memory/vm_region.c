@@ -0,0 +1,27 @@
+#include "vm_region.h"
+#include "../tools.h"
+
+static vm_region_t regions[VM_MAX_REGIONS];
+static size_t region_count = 0;
+
+vm_region_t *vm_region_add(size_t start, size_t end, uint8 type, uint8 flags) {
+    ASSERT((start & 0xFFF) == 0);
+    ASSERT((end & 0xFFF) == 0);
+    ASSERT(start < end);
+    ASSERT(region_count < VM_MAX_REGIONS);
+
+    vm_region_t *region = &regions[region_count++];
+    region->start = start;
+    region->end = end;
+    region->type = type;
+    region->flags = flags;
+    return region;
+}
+
+vm_region_t *vm_region_find(size_t address) {
+    size_t i;
+    for (i = 0; i < region_count; i++)
+        if (address >= regions[i].start && address < regions[i].end)
+            return &regions[i];
+    return 0;
+}
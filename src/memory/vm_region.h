@@ -0,0 +1,43 @@
+#ifndef VM_REGION_H
+#define VM_REGION_H
+
+#include "../tools.h"
+
+/**
+ * Virtual memory regions for demand paging
+ * A region reserves a range of virtual addresses without mapping anything. The first access to a page inside it
+ * raises a page fault, and page_fault() then maps a freshly zeroed frame there (demand-zero).
+ * Memory is therefore only committed once it is actually touched.
+ *
+ * The same layout applies to every address space, e.g. the kernel heap lives at the same virtual addresses in every
+ * page directory. The page is mapped into whichever directory took the fault.
+ * Stacks are not demand paged: the kernel runs on them in ring 0, so the CPU would push the page fault frame onto the
+ * very page that is missing.
+ */
+
+#define VM_MAX_REGIONS 16
+
+// region types
+#define VM_ANONYMOUS 0 // plain zero-filled memory
+#define VM_HEAP      1 // backs a heap_t, which grows up inside the region through expand()
+
+// region flags
+#define VM_WRITABLE  0x1
+#define VM_KERNEL    0x2 // not accessible from user mode
+
+typedef struct vm_region {
+    size_t start; // page aligned
+    size_t end; // page aligned, one past the last byte
+    uint8 type;
+    uint8 flags;
+} vm_region_t;
+
+/**
+ * Reserves [start, end) so that pages inside it are mapped on first touch
+ */
+vm_region_t *vm_region_add(size_t start, size_t end, uint8 type, uint8 flags);
+
+// returns the region containing address, or 0 if there is none
+vm_region_t *vm_region_find(size_t address);
+
+#endif
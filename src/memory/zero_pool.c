@@ -0,0 +1,82 @@
+#include "zero_pool.h"
+#include "buddy.h"
+#include "kmap.h"
+#include "../screen/monitor.h"
+#include "../tools.h"
+
+static size_t pool[ZERO_POOL_SIZE];
+static size_t count = 0;
+static size_t hits = 0;
+static size_t misses = 0;
+
+// the pool is used from the page fault handler too, every access below is under irq_save (the buddy allocator has its own lock)
+
+size_t zero_pool_alloc() {
+    size_t eflags = irq_save();
+    size_t frame;
+
+    if (count > 0) {
+        frame = pool[--count];
+        hits++;
+        irq_restore(eflags);
+        return frame;
+    }
+
+    frame = buddy_alloc(0);
+    // running out of frames altogether is not a miss, nothing gets zeroed on the spot
+    if (frame != BUDDY_NONE)
+        misses++;
+    irq_restore(eflags);
+
+    if (frame != BUDDY_NONE)
+        zero_page_physical(frame * 0x1000);
+    return frame;
+}
+
+int zero_pool_refill() {
+    if (count >= ZERO_POOL_SIZE)
+        return 0;
+
+    size_t frame = buddy_alloc(0);
+    if (frame == BUDDY_NONE)
+        return 0;
+
+    // the slow part runs with interrupts on
+    zero_page_physical(frame * 0x1000);
+
+    size_t eflags = irq_save();
+    pool[count++] = frame;
+    irq_restore(eflags);
+    return 1;
+}
+
+size_t zero_pool_steal() {
+    size_t eflags = irq_save();
+    size_t frame = BUDDY_NONE;
+    if (count > 0)
+        frame = pool[--count];
+    irq_restore(eflags);
+    return frame;
+}
+
+size_t zero_pool_count() {
+    return count;
+}
+
+size_t zero_pool_hits() {
+    return hits;
+}
+
+size_t zero_pool_misses() {
+    return misses;
+}
+
+void zero_pool_print_stats() {
+    monitor_write("zeroed frames: ");
+    monitor_write_dec(count);
+    monitor_write(" pooled, ");
+    monitor_write_dec(hits);
+    monitor_write(" hits, ");
+    monitor_write_dec(misses);
+    monitor_write(" misses\n");
+}
@@ -0,0 +1,43 @@
+#ifndef ZERO_POOL_H
+#define ZERO_POOL_H
+
+#include "../tools.h"
+
+/**
+ * Pool of pre-zeroed frames
+ * New page tables and demand-zero pages need a frame full of zeros. Instead of clearing 4KB on the fault path,
+ * the idle loop keeps this pool topped up with frames it zeroed while the CPU had nothing else to do.
+ * zero_pool_alloc() takes from the pool first and only zeroes a frame itself when the pool is empty (a miss).
+ *
+ * Frames in the pool count as allocated as far as the buddy allocator is concerned.
+ */
+
+#define ZERO_POOL_SIZE 64
+
+/**
+ * Returns the index of a zeroed frame, or BUDDY_NONE if there are no free frames left
+ * Must not be called before paging is enabled, a miss zeroes the frame through kmap
+ */
+size_t zero_pool_alloc();
+
+/**
+ * Zeroes one more frame for the pool, returns 0 if there was nothing to do (pool full or out of frames)
+ * Meant to be called repeatedly from the idle loop
+ */
+int zero_pool_refill();
+
+/**
+ * Takes a zeroed frame out of the pool for a caller that found the buddy allocator empty, returns BUDDY_NONE if the pool is empty too
+ * The frame goes straight to the caller, the buddy allocator never sees it
+ */
+size_t zero_pool_steal();
+
+size_t zero_pool_count();
+
+// allocations served from the pool / that had to zero a frame on the spot
+size_t zero_pool_hits();
+size_t zero_pool_misses();
+
+void zero_pool_print_stats();
+
+#endif
@@ -44,4 +44,19 @@ struct multiboot {
 
 typedef struct multiboot_header multiboot_header_t;
 
+// type of an mmap entry describing RAM we are free to use, any other type is reserved
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+// one entry of the memory map at mmap_addr, entries are size + 4 bytes apart
+struct multiboot_mmap_entry {
+    size_t size; // size of the rest of the entry, not counting this field
+    size_t base_addr_low;
+    size_t base_addr_high;
+    size_t length_low;
+    size_t length_high;
+    size_t type;
+} __attribute__((packed));
+
+typedef struct multiboot_mmap_entry multiboot_mmap_entry_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "fpu.h"
+#include "task.h"
+#include "../memory/slab.h"
+#include "../interrupts/isr.h"
+#include "../tools.h"
+
+#define CR0_MP 0x2 // monitor coprocessor: wait/fwait honours TS as well
+#define CR0_EM 0x4 // emulation: every FPU instruction faults, must be clear
+#define CR0_TS 0x8 // task switched: the next FPU instruction raises #NM
+#define CR0_NE 0x20 // report FPU errors through #MF instead of the legacy IRQ13
+#define CR4_OSFXSR     0x200 // fxsave/fxrstor and SSE instructions are allowed
+#define CR4_OSXMMEXCPT 0x400 // unmasked SSE exceptions raise #XM
+
+extern volatile task_t *current_task;
+
+// every save area comes from this cache
+static kmem_cache_t *fpu_cache;
+// task whose state is in the FPU registers right now, 0 if none
+static task_t *fpu_owner = 0;
+// mirrors CR0.TS so that switches between tasks that do not use the FPU never write CR0
+static int ts_set = 0;
+// the state right after fninit, every task starts from a copy of it
+static uint8 *initial_state;
+
+static void set_ts() {
+    size_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+    ts_set = 1;
+}
+
+static void clear_ts() {
+    asm volatile("clts");
+    ts_set = 0;
+}
+
+static void fxsave(uint8 *area) {
+    asm volatile("fxsave (%0)" : : "r"(area) : "memory");
+}
+
+static void fxrstor(uint8 *area) {
+    asm volatile("fxrstor (%0)" : : "r"(area) : "memory");
+}
+
+/**
+ * #NM handler, the current task used the FPU for the first time since it was switched to
+ */
+static void device_not_available(registers_t *regs) {
+    clear_ts();
+
+    task_t *task = (task_t*)current_task;
+    if (fpu_owner == task)
+        return;
+
+    if (fpu_owner)
+        fxsave(fpu_owner->fpu_state);
+
+    if (!task->fpu_state) {
+        task->fpu_state = (uint8*)kmem_cache_alloc(fpu_cache);
+        memcpy(task->fpu_state, initial_state, FPU_STATE_SIZE);
+    }
+    fxrstor(task->fpu_state);
+    fpu_owner = task;
+}
+
+void fpu_init() {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 24)) || !(edx & (1 << 25))) {
+        // bit 24: fxsave/fxrstor, bit 25: SSE
+        PANIC("CPU has no FXSR/SSE support");
+    }
+
+    size_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    fpu_cache = kmem_cache_create("fpu_state", FPU_STATE_SIZE, 16, 0);
+
+    // fninit leaves MXCSR alone, it is already at its reset value (all SSE exceptions masked)
+    asm volatile("fninit");
+    initial_state = (uint8*)kmem_cache_alloc(fpu_cache);
+    fxsave(initial_state);
+
+    register_interrupt_handler(7, &device_not_available);
+
+    // nobody owns the registers yet, the first task to use them faults
+    set_ts();
+}
+
+void fpu_switch(task_t *next) {
+    if (next == fpu_owner) {
+        // the registers still hold next's state
+        if (ts_set)
+            clear_ts();
+    } else if (!ts_set) {
+        set_ts();
+    }
+}
+
+void fpu_fork(task_t *parent, task_t *child) {
+    child->fpu_state = 0;
+    if (!parent->fpu_state)
+        return;
+
+    // the registers are newer than the save area while the parent owns them
+    if (fpu_owner == parent) {
+        if (ts_set)
+            clear_ts();
+        fxsave(parent->fpu_state);
+    }
+
+    child->fpu_state = (uint8*)kmem_cache_alloc(fpu_cache);
+    memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+}
+
+void fpu_release(task_t *task) {
+    if (fpu_owner == task)
+        fpu_owner = 0;
+    kmem_cache_free(fpu_cache, task->fpu_state);
+    task->fpu_state = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "../tools.h"
+
+/**
+ * Lazy FPU/SSE context switching
+ * Saving and restoring the x87/SSE registers (fxsave/fxrstor, 512 bytes) on every task switch would make every switch
+ * more expensive, even between tasks that never touch the FPU. Instead the registers stay loaded with the state of
+ * their owner, and switching to any other task sets CR0.TS. The first FPU/SSE instruction that task executes then
+ * raises #NM (device not available, vector 7), and only then is the owner's state saved and the task's own loaded.
+ *
+ * A task gets its save area the first time it uses the FPU, so tasks that never do cost nothing.
+ */
+
+// size of the fxsave area, it has to be 16 byte aligned
+#define FPU_STATE_SIZE 512
+
+struct task;
+
+// enables the FPU and SSE (CR0, CR4.OSFXSR/OSXMMEXCPT) and installs the #NM handler
+void fpu_init();
+
+// called when switching to next, arms CR0.TS unless next owns the FPU registers
+void fpu_switch(struct task *next);
+
+// gives child a copy of parent's FPU state, if parent has one
+void fpu_fork(struct task *parent, struct task *child);
+
+// frees the task's save area, the task must not run again
+void fpu_release(struct task *task);
+
+#endif
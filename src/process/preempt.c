@@ -0,0 +1,31 @@
+#include "preempt.h"
+#include "task.h"
+#include "../tools.h"
+
+extern volatile task_t *current_task;
+
+volatile uint8 need_resched = 0;
+
+void preempt_disable() {
+    // before tasking starts there is nothing to switch to
+    if (current_task)
+        current_task->preempt_count++;
+}
+
+void preempt_enable() {
+    if (!current_task)
+        return;
+
+    ASSERT(current_task->preempt_count > 0);
+    if (--current_task->preempt_count || !need_resched)
+        return;
+
+    // with interrupts off the caller is still in a critical section, the next IRQ return picks the switch up
+    if (irqs_enabled())
+        switch_task();
+}
+
+void preempt_irq_return() {
+    if (need_resched && current_task && !current_task->preempt_count)
+        switch_task();
+}
@@ -0,0 +1,31 @@
+#ifndef PREEMPT_H
+#define PREEMPT_H
+
+#include "../tools.h"
+
+/**
+ * Kernel preemption
+ * The timer (and anything that wakes a more important task) no longer switches tasks from inside the interrupt handler,
+ * it only sets need_resched. The switch happens at the next preemption point:
+ *  - on return from an IRQ (irq_handler), if the interrupted task can be preempted
+ *  - in preempt_enable, when the outermost preempt_disable section of the task ends
+ *
+ * Code that must not be switched away from (shared kernel structures like the frame allocator or the filesystem) runs
+ * between preempt_disable and preempt_enable and keeps interrupts on. Only data an interrupt handler touches as well
+ * needs interrupts off, and that also keeps the task from being preempted.
+ * The count belongs to the task, so a task that blocks inside such a section does not hold up the ones that run meanwhile.
+ */
+
+// set when the running task should give up the CPU at the next preemption point
+extern volatile uint8 need_resched;
+
+// the current task cannot be switched away from until the matching preempt_enable, nests
+void preempt_disable();
+
+// ends a preempt_disable section, switches tasks right away if one is pending and this was the outermost section
+void preempt_enable();
+
+// called on return from an IRQ, switches tasks if one is pending and the interrupted task can be preempted
+void preempt_irq_return();
+
+#endif
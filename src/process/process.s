@@ -1,37 +1,86 @@
-[GLOBAL read_eip]
-read_eip:
-    pop eax                     ; Get the return address
-    jmp eax                     ; Return. Can't use RET because return
-                                ; address popped off the stack. 
-
-[GLOBAL copy_page_physical]
-copy_page_physical:
-    push ebx              ; According to __cdecl, we must preserve the contents of EBX.
-    pushf                 ; push EFLAGS, so we can pop it and reenable interrupts
-                          ; later, if they were enabled anyway.
-    cli                   ; Disable interrupts, so we aren't interrupted.
-                          ; Load these in BEFORE we disable paging!
-    mov ebx, [esp+12]     ; Source address
-    mov ecx, [esp+16]     ; Destination address
-
-    mov edx, cr0          ; Get the control register...
-    and edx, 0x7fffffff   ; and...
-    mov cr0, edx          ; Disable paging.
-
-    mov edx, 1024         ; 1024*4bytes = 4096 bytes
-  
-.loop:
-    mov eax, [ebx]        ; Get the word at the source address
-    mov [ecx], eax        ; Store it at the dest address
-    add ebx, 4            ; Source address += sizeof(word)
-    add ecx, 4            ; Dest address += sizeof(word)
-    dec edx               ; One less word to do
-    jnz .loop             
-
-    mov edx, cr0          ; Get the control register again
-    or  edx, 0x80000000   ; and...
-    mov cr0, edx          ; Enable paging.
-
-    popf                  ; Pop EFLAGS back.
-    pop ebx               ; Get the original value of EBX back.
+; switch_to(task_t *prev, task_t *next)
+; A switched out task is described by its stack pointer alone, everything else sits on top of its stack:
+;   [esp]    EFLAGS
+;   [esp+4]  EDI, ESI, EBX, EBP (the registers __cdecl says a callee must preserve)
+;   [esp+20] the address switch_to was called from
+; EAX, ECX and EDX are caller-saved, so the compiler does not expect them to survive the call anyway.
+; The first two members of task_t are esp and cr3 (see task.h).
+
+[GLOBAL switch_to]
+switch_to:
+    mov eax, [esp+4]      ; prev
+    mov edx, [esp+8]      ; next
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushf
+
+    mov [eax], esp        ; prev->esp = esp
+    mov esp, [edx]        ; esp = next->esp, we are on next's stack from here
+
+    mov ecx, [edx+4]      ; next->cr3
+    mov eax, cr3
+    cmp eax, ecx          ; tasks sharing a directory keep their TLB entries
+    je .same_directory
+    mov cr3, ecx
+.same_directory:
+
+    popf
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    xor eax, eax          ; a child started by fork_task sees fork_task return 0
+    ret
+
+; int fork_task(task_t *child)
+; Pushes the same frame switch_to does and stores it as the child's stack pointer, then lets
+; fork_address_space (task.c) clone the address space, which copies this stack with the frame on it.
+; Returns 1 here. The child returns 0 from the same call once it is first switched to.
+
+[GLOBAL fork_task]
+[EXTERN fork_address_space]
+fork_task:
+    mov eax, [esp+4]      ; child
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushf
+    mov [eax], esp        ; child->esp
+
+    push eax
+    call fork_address_space
+    add esp, 4
+
+    add esp, 20           ; the frame is only there to be copied, our registers were preserved by the call
+    mov eax, 1
+    ret
+
+; Both take page aligned virtual addresses, see memory/kmap.c for copying frames by their physical address.
+; Paging stays on and interrupts are left alone, the string instructions move a dword per iteration.
+
+[GLOBAL copy_page]
+copy_page:
+    push esi              ; According to __cdecl, we must preserve ESI and EDI.
+    push edi
+    mov edi, [esp+12]     ; Destination address
+    mov esi, [esp+16]     ; Source address
+    mov ecx, 1024         ; 1024*4bytes = 4096 bytes
+    cld                   ; Copy upwards.
+    rep movsd
+    pop edi
+    pop esi
+    ret
+
+[GLOBAL zero_page]
+zero_page:
+    push edi
+    mov edi, [esp+8]      ; Destination address
+    xor eax, eax
+    mov ecx, 1024
+    cld
+    rep stosd
+    pop edi
     ret
@@ -0,0 +1,77 @@
+#include "sched.h"
+#include "task.h"
+#include "../tools.h"
+
+// bit p is set while run_queues[p] has a task in it
+static uint32 ready_bitmap = 0;
+
+typedef struct run_queue {
+    task_t *head;
+    task_t *tail;
+} run_queue_t;
+
+static run_queue_t run_queues[SCHED_PRIORITIES];
+
+// index of the lowest set bit, the bitmap must not be 0
+static uint32 first_ready() {
+    uint32 index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(ready_bitmap));
+    return index;
+}
+
+void sched_enqueue(task_t *task) {
+    ASSERT(task->priority < SCHED_PRIORITIES);
+    run_queue_t *queue = &run_queues[task->priority];
+
+    task->next = 0;
+    task->prev = queue->tail;
+    if (queue->tail)
+        queue->tail->next = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+
+    ready_bitmap |= 1 << task->priority;
+}
+
+void sched_dequeue(task_t *task) {
+    run_queue_t *queue = &run_queues[task->priority];
+
+    if (task->prev)
+        task->prev->next = task->next;
+    else
+        queue->head = task->next;
+    if (task->next)
+        task->next->prev = task->prev;
+    else
+        queue->tail = task->prev;
+    task->next = task->prev = 0;
+
+    if (!queue->head)
+        ready_bitmap &= ~(1 << task->priority);
+}
+
+task_t *sched_pick_next() {
+    if (!ready_bitmap)
+        return 0;
+
+    task_t *task = run_queues[first_ready()].head;
+    sched_dequeue(task);
+    return task;
+}
+
+int sched_outranked(uint8 priority) {
+    return ready_bitmap && first_ready() < priority;
+}
+
+int sched_ready() {
+    return ready_bitmap != 0;
+}
+
+int sched_tick(task_t *current, size_t ticks) {
+    if (current->timeslice > ticks)
+        current->timeslice -= ticks;
+    else
+        current->timeslice = 0;
+    return current->timeslice == 0 || sched_outranked(current->priority);
+}
@@ -0,0 +1,53 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "../tools.h"
+
+/**
+ * O(1) priority scheduler
+ * Every priority has its own run queue (a doubly linked list of ready tasks) and a bit in a 32 bit bitmap that is set
+ * while the queue is not empty. The most important ready task is found with a single bsf on the bitmap, and tasks are
+ * added to and removed from their queue in constant time, so nothing here depends on the number of tasks.
+ *
+ * Tasks of the same priority take turns (round robin), each running for its timeslice before it goes to the back of its queue.
+ * A task that becomes ready while a less important one runs takes over at the next timer tick.
+ * The running task is not in any run queue.
+ */
+
+// 0 is the most important priority
+#define SCHED_PRIORITIES        32
+// priority of the idle task, below every run queue so it never gets queued and everything outranks it
+#define SCHED_IDLE_PRIORITY     SCHED_PRIORITIES
+#define SCHED_DEFAULT_PRIORITY  16
+// lent to a task woken by input (see wake_up_interactive) for one timeslice, it preempts everything at the default priority
+#define SCHED_INTERACTIVE_PRIORITY 4
+
+// timer ticks a task runs before the next task of the same priority gets its turn
+// more important tasks get longer slices, from SCHED_BASE_TIMESLICE up to SCHED_BASE_TIMESLICE+7
+#define SCHED_BASE_TIMESLICE 5
+#define SCHED_TIMESLICE(priority) (SCHED_BASE_TIMESLICE + (SCHED_PRIORITIES - 1 - (priority)) / 4)
+
+struct task;
+
+// adds a ready task to the back of the queue for its priority
+void sched_enqueue(struct task *task);
+
+// removes a task from its run queue
+void sched_dequeue(struct task *task);
+
+// removes and returns the most important ready task, 0 if there is none
+struct task *sched_pick_next();
+
+// returns 1 if a task more important than priority is ready
+int sched_outranked(uint8 priority);
+
+// returns 1 if any task is ready
+int sched_ready();
+
+/**
+ * Charges the running task for the timer ticks since it was last charged (always 1 unless the timer is tickless)
+ * Returns 1 when it should be preempted: its timeslice ran out or a more important task is ready
+ */
+int sched_tick(struct task *current, size_t ticks);
+
+#endif
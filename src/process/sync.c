@@ -0,0 +1,314 @@
+#include "sync.h"
+#include "sched.h"
+#include "preempt.h"
+#include "../screen/monitor.h"
+#include "../tools.h"
+
+extern volatile task_t *current_task;
+
+// every lock that has been initialised, for lock_print_stats
+static lock_stats_t *registered = 0;
+
+static void register_lock(lock_stats_t *stats, const char *name) {
+    stats->name = name;
+    stats->acquired = 0;
+    stats->contended = 0;
+    stats->wait_cycles = 0;
+
+    size_t eflags = irq_save();
+    stats->next = registered;
+    registered = stats;
+    irq_restore(eflags);
+}
+
+/* spinlocks */
+
+void spin_lock_init(spinlock_t *lock, const char *name) {
+    lock->next = lock->owner = 0;
+    register_lock(&lock->stats, name);
+}
+
+void spin_lock(spinlock_t *lock) {
+    preempt_disable();
+    // checked by the scheduler, a task must not switch away while it holds one
+    if (current_task)
+        current_task->spinlocks_held++;
+
+    uint16 ticket = 1;
+    asm volatile("lock xaddw %0, %1" : "+r"(ticket), "+m"(lock->next) : : "memory");
+
+    if (lock->owner != ticket) {
+        uint64 start = rdtsc();
+        while (lock->owner != ticket)
+            asm volatile("pause" : : : "memory");
+        lock->stats.contended++;
+        lock->stats.wait_cycles += rdtsc() - start;
+    }
+    lock->stats.acquired++;
+}
+
+void spin_unlock(spinlock_t *lock) {
+    // only the holder writes owner, a plain store after everything the section wrote is enough on x86
+    asm volatile("" : : : "memory");
+    lock->owner++;
+    if (current_task)
+        current_task->spinlocks_held--;
+    preempt_enable();
+}
+
+size_t spin_lock_irqsave(spinlock_t *lock) {
+    size_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *lock, size_t flags) {
+    asm volatile("" : : : "memory");
+    lock->owner++;
+    if (current_task)
+        current_task->spinlocks_held--;
+    irq_restore(flags);
+    preempt_enable();
+}
+
+/* mutexes */
+
+void mutex_init(mutex_t *mutex, const char *name) {
+    mutex->owner = 0;
+    wait_queue_init(&mutex->waiters);
+    mutex->next_held = 0;
+    register_lock(&mutex->stats, name);
+}
+
+// the uncontended path, owner goes from 0 to task in one instruction
+static int try_acquire(mutex_t *mutex, task_t *task) {
+    task_t *old;
+    asm volatile("lock cmpxchgl %2, %1" : "=a"(old), "+m"(mutex->owner) : "r"(task), "0"(0) : "memory");
+    return old == 0;
+}
+
+// the owner's list of held mutexes is only changed by the owner itself
+static void acquired(mutex_t *mutex, task_t *task) {
+    mutex->next_held = task->held_mutexes;
+    task->held_mutexes = mutex;
+    mutex->stats.acquired++;
+}
+
+/**
+ * Interrupts off, task is about to wait for a mutex at the given priority
+ * Lends that priority to the owner, and to whatever the owner itself is waiting for, until someone at least as important
+ */
+static void inherit_priority(task_t *owner, uint8 priority) {
+    while (owner && priority < owner->priority) {
+        task_set_priority(owner, priority);
+        if (!owner->waiting_for)
+            break;
+        owner = owner->waiting_for->owner;
+    }
+}
+
+uint8 mutex_inherited_priority(task_t *task) {
+    uint8 priority = SCHED_PRIORITIES;
+    mutex_t *mutex;
+    for (mutex = task->held_mutexes; mutex; mutex = mutex->next_held) {
+        task_t *waiter;
+        for (waiter = mutex->waiters.head; waiter; waiter = waiter->next)
+            if (waiter->priority < priority)
+                priority = waiter->priority;
+    }
+    return priority;
+}
+
+void mutex_lock(mutex_t *mutex) {
+    task_t *task = (task_t*)current_task;
+    ASSERT(task && mutex->owner != task);
+
+    if (try_acquire(mutex, task)) {
+        acquired(mutex, task);
+        return;
+    }
+
+    uint64 start = rdtsc();
+    size_t eflags = irq_save();
+    mutex->stats.contended++;
+
+    // the owner may have let go before interrupts were turned off
+    while (!try_acquire(mutex, task)) {
+        inherit_priority(mutex->owner, task->priority);
+        task->waiting_for = mutex;
+        sleep_on(&mutex->waiters);
+        task->waiting_for = 0;
+    }
+
+    irq_restore(eflags);
+    mutex->stats.wait_cycles += rdtsc() - start;
+    acquired(mutex, task);
+}
+
+int mutex_trylock(mutex_t *mutex) {
+    task_t *task = (task_t*)current_task;
+    if (!try_acquire(mutex, task))
+        return 0;
+    acquired(mutex, task);
+    return 1;
+}
+
+void mutex_unlock(mutex_t *mutex) {
+    task_t *task = (task_t*)current_task;
+    ASSERT(mutex->owner == task);
+
+    // a waiter more important than us runs as soon as the mutex is free, at the preempt_enable
+    preempt_disable();
+    size_t eflags = irq_save();
+
+    mutex_t **held = &task->held_mutexes;
+    while (*held != mutex)
+        held = &(*held)->next_held;
+    *held = mutex->next_held;
+    mutex->next_held = 0;
+    mutex->owner = 0;
+
+    // give back whatever was inherited through this mutex, keep what the others still lend us
+    if (task->priority != task->base_priority) {
+        uint8 inherited = mutex_inherited_priority(task);
+        task_set_priority(task, inherited < task->base_priority ? inherited : task->base_priority);
+    }
+
+    // the waiter retries the cmpxchg, the most important one gets to go first
+    wake_up_priority(&mutex->waiters);
+
+    irq_restore(eflags);
+    preempt_enable();
+}
+
+/* semaphores */
+
+void sema_init(semaphore_t *sema, int count, const char *name) {
+    sema->count = count;
+    wait_queue_init(&sema->waiters);
+    register_lock(&sema->stats, name);
+}
+
+void down(semaphore_t *sema) {
+    size_t eflags = irq_save();
+
+    if (sema->count == 0) {
+        uint64 start = rdtsc();
+        sema->stats.contended++;
+        while (sema->count == 0)
+            sleep_on(&sema->waiters);
+        sema->stats.wait_cycles += rdtsc() - start;
+    }
+    sema->count--;
+    sema->stats.acquired++;
+
+    irq_restore(eflags);
+}
+
+int down_trylock(semaphore_t *sema) {
+    size_t eflags = irq_save();
+    int taken = sema->count > 0;
+    if (taken) {
+        sema->count--;
+        sema->stats.acquired++;
+    }
+    irq_restore(eflags);
+    return taken;
+}
+
+void up(semaphore_t *sema) {
+    preempt_disable();
+    size_t eflags = irq_save();
+    sema->count++;
+    wake_up(&sema->waiters);
+    irq_restore(eflags);
+    preempt_enable();
+}
+
+/* reader-writer locks */
+
+void rwlock_init(rwlock_t *lock, const char *name) {
+    lock->readers = 0;
+    lock->writer = 0;
+    lock->writers_waiting = 0;
+    wait_queue_init(&lock->read_waiters);
+    wait_queue_init(&lock->write_waiters);
+    register_lock(&lock->stats, name);
+}
+
+void read_lock(rwlock_t *lock) {
+    size_t eflags = irq_save();
+
+    // waiting writers go first, otherwise a steady stream of readers would starve them
+    if (lock->writer || lock->writers_waiting) {
+        uint64 start = rdtsc();
+        lock->stats.contended++;
+        while (lock->writer || lock->writers_waiting)
+            sleep_on(&lock->read_waiters);
+        lock->stats.wait_cycles += rdtsc() - start;
+    }
+    lock->readers++;
+    lock->stats.acquired++;
+
+    irq_restore(eflags);
+}
+
+void read_unlock(rwlock_t *lock) {
+    preempt_disable();
+    size_t eflags = irq_save();
+    ASSERT(lock->readers > 0);
+    if (--lock->readers == 0)
+        wake_up(&lock->write_waiters);
+    irq_restore(eflags);
+    preempt_enable();
+}
+
+void write_lock(rwlock_t *lock) {
+    size_t eflags = irq_save();
+
+    if (lock->writer || lock->readers) {
+        uint64 start = rdtsc();
+        lock->stats.contended++;
+        lock->writers_waiting++;
+        while (lock->writer || lock->readers)
+            sleep_on(&lock->write_waiters);
+        lock->writers_waiting--;
+        lock->stats.wait_cycles += rdtsc() - start;
+    }
+    lock->writer = (task_t*)current_task;
+    lock->stats.acquired++;
+
+    irq_restore(eflags);
+}
+
+void write_unlock(rwlock_t *lock) {
+    preempt_disable();
+    size_t eflags = irq_save();
+    ASSERT(lock->writer == current_task);
+    lock->writer = 0;
+    // the next writer if there is one, every reader that queued up behind it otherwise
+    if (lock->writers_waiting)
+        wake_up(&lock->write_waiters);
+    else
+        wake_up_all(&lock->read_waiters);
+    irq_restore(eflags);
+    preempt_enable();
+}
+
+void lock_print_stats() {
+    monitor_write("contended locks (acquired/contended/wait cycles):\n");
+    lock_stats_t *stats;
+    for (stats = registered; stats; stats = stats->next) {
+        if (!stats->contended)
+            continue;
+        monitor_write("  ");
+        monitor_write((char*)stats->name);
+        monitor_write(": ");
+        monitor_write_dec(stats->acquired);
+        monitor_write("/");
+        monitor_write_dec(stats->contended);
+        monitor_write("/");
+        monitor_write_dec((uint32)stats->wait_cycles);
+        monitor_write("\n");
+    }
+}
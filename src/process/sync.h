@@ -0,0 +1,91 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "../tools.h"
+#include "task.h"
+#include "wait.h"
+
+/**
+ * Locks for kernel code
+ *  - spinlock_t: ticket lock, busy waits, for short sections. Holding one disables preemption, use the _irqsave variants
+ *    if an interrupt handler takes the lock as well. The holder must not block: on a single CPU contention can only mean
+ *    the holder went to sleep or an interrupt handler wants a lock taken without _irqsave, and either way the waiter spins
+ *    forever since the holder never gets the CPU back. Switching away while holding one fails an ASSERT instead.
+ *  - mutex_t: sleeping lock with a single cmpxchg as the uncontended path. Waiters block on a wait queue, and the owner
+ *    inherits the priority of its most important waiter (through chains of mutexes) so it cannot be starved by tasks
+ *    less important than that waiter.
+ *  - semaphore_t: counting semaphore, down blocks while the count is 0. up may be called from interrupt handlers.
+ *  - rwlock_t: sleeping reader-writer lock, any number of readers or one writer. Waiting writers hold off new readers.
+ *
+ * Every lock keeps lock_stats_t counters and is registered by its init function, lock_print_stats lists the contended ones.
+ * Mutexes, semaphores and rwlocks may block, so they can only be used by tasks, not interrupt handlers (except up).
+ */
+
+typedef struct lock_stats {
+    const char *name;
+    uint32 acquired;          // times the lock was taken
+    uint32 contended;         // times taking it had to spin or sleep
+    uint64 wait_cycles;       // time spent spinning or sleeping for it
+    struct lock_stats *next;  // every registered lock
+} lock_stats_t;
+
+typedef struct spinlock {
+    volatile uint16 next;     // ticket handed to the next task that wants the lock
+    volatile uint16 owner;    // ticket currently allowed in
+    lock_stats_t stats;
+} spinlock_t;
+
+typedef struct mutex {
+    task_t * volatile owner;  // 0 while unlocked, set with cmpxchg
+    wait_queue_t waiters;
+    struct mutex *next_held;  // next mutex held by the same owner
+    lock_stats_t stats;
+} mutex_t;
+
+typedef struct semaphore {
+    volatile int count;
+    wait_queue_t waiters;
+    lock_stats_t stats;
+} semaphore_t;
+
+typedef struct rwlock {
+    int readers;              // readers holding the lock
+    task_t *writer;           // writer holding the lock, 0 if none
+    int writers_waiting;
+    wait_queue_t read_waiters;
+    wait_queue_t write_waiters;
+    lock_stats_t stats;
+} rwlock_t;
+
+void spin_lock_init(spinlock_t *lock, const char *name);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+// also disables interrupts, returns the flags to give to spin_unlock_irqrestore
+size_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, size_t flags);
+
+void mutex_init(mutex_t *mutex, const char *name);
+void mutex_lock(mutex_t *mutex);
+// returns 1 if the mutex was taken, 0 if it is held by someone else
+int mutex_trylock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+
+// most important priority among the waiters of the mutexes the task holds, SCHED_PRIORITIES if there are none
+uint8 mutex_inherited_priority(task_t *task);
+
+void sema_init(semaphore_t *sema, int count, const char *name);
+void down(semaphore_t *sema);
+// returns 1 if the count was taken, 0 if it was 0
+int down_trylock(semaphore_t *sema);
+void up(semaphore_t *sema);
+
+void rwlock_init(rwlock_t *lock, const char *name);
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+// prints the counters of every lock that was ever contended
+void lock_print_stats();
+
+#endif
@@ -1,43 +1,208 @@
 #include "task.h"
 #include "../memory/paging.h"
 #include "../memory/kheap.h"
+#include "../memory/slab.h"
+#include "sched.h"
+#include "fpu.h"
+#include "wait.h"
+#include "preempt.h"
+#include "sync.h"
+#include "../drivers/timer/timer.h"
+#include "../memory/zero_pool.h"
 #include "../screen/monitor.h"
 #include "../tools.h"
 
 
-// current running stack
+// current running task, it is not in any run queue while it runs
 volatile task_t *current_task;
-// linked list of tasks
-volatile task_t *ready_queue;
 
 // needed to access members of paging.c
 extern page_directory_t *kernel_directory;
 extern page_directory_t *current_directory;
 extern size_t initial_esp;
-extern void alloc_frame(page_t*, int, int);
-extern size_t read_eip();
+// defined in process.s
+extern int fork_task(task_t *child);
 
 // ensures unique pid
 size_t next_pid = 1;
 
+// every task_t comes from this cache
+static kmem_cache_t *task_cache;
+
+// runs when no task is ready, it is never in a run queue
+static task_t *idle_task;
+
+// exited tasks waiting for the reaper, linked through next
+static task_t *dead_tasks = 0;
+static wait_queue_t reaper_queue;
+
+// parents blocked in wait() sleep here until one of their children has been reaped
+static wait_queue_t child_exit_queue;
+
+// stacks of exited kernel threads, the next kthread_create reuses them instead of allocating and touching a new one
+#define KSTACK_CACHE_SIZE 8
+static uint8 *stack_cache[KSTACK_CACHE_SIZE];
+static size_t stack_cache_count = 0;
+
+static task_t *alloc_task(uint8 priority);
+static task_t *kernel_task(void (*fn)(void *arg), void *arg, uint8 priority);
+static void idle_thread(void *unused);
+static void reaper(void *unused);
+static size_t deadline(task_t *task);
+static void schedule(task_t *prev);
+static void task_unboost(task_t *task);
+
 /**
  * Kicks off the first process
  */ 
 void initialise_tasking() {
 
-    deact_itr();
+    size_t eflags = irq_save();
 
     move_stack((void*)0xE0000000, 0x2000);
 
+    task_cache = kmem_cache_create("task", sizeof(task_t), 0, 0);
+
+    // FPU/SSE state is switched lazily, only for tasks that use it
+    fpu_init();
+
     // setup the root task which is the kernel
-    current_task = ready_queue = (task_t*) kmalloc(sizeof(task_t));
+    // it runs on the stack move_stack set up above, so it has no kernel thread stack
+    current_task = alloc_task(SCHED_DEFAULT_PRIORITY);
     current_task->id = next_pid++;
-    current_task->esp = current_task->ebp = 0;
-    current_task->eip = 0;
+    // saved by switch_to the first time the kernel task is switched away from
+    current_task->esp = 0;
+    current_task->cr3 = page_directory_physical(current_directory);
     current_task->page_directory = current_directory;
-    current_task->next = 0;
 
-    act_itr();
+    // a kernel thread with pid 0, only runs when nothing else is ready
+    idle_task = kernel_task(&idle_thread, 0, SCHED_IDLE_PRIORITY);
+    idle_task->id = 0;
+
+    // frees whatever exited tasks leave behind
+    wait_queue_init(&reaper_queue);
+    wait_queue_init(&child_exit_queue);
+    kthread_create(&reaper, 0);
+
+    irq_restore(eflags);
+}
+
+// a task_t with no parent, children, stack or FPU state, ready to run at the given priority
+static task_t *alloc_task(uint8 priority) {
+  task_t *task = (task_t*) kmem_cache_alloc(task_cache);
+  task->fpu_state = 0;
+  task->stack = 0;
+  task->priority = task->base_priority = priority;
+  task->timeslice = priority < SCHED_PRIORITIES ? SCHED_TIMESLICE(priority) : 0;
+  task->state = TASK_READY;
+  task->wait_queue = 0;
+  task->next = task->prev = 0;
+  task->parent = 0;
+  task->first_child = 0;
+  task->next_sibling = task->prev_sibling = 0;
+  task->exit_code = 0;
+  task->preempt_count = 0;
+  task->spinlocks_held = 0;
+  task->boosted = 0;
+  task->waiting_for = 0;
+  task->held_mutexes = 0;
+  return task;
+}
+
+// first thing a kernel thread runs, switch_to returns into it with fn and arg on the stack
+static void kthread_start(void (*fn)(void *arg), void *arg) {
+  // the switch to a new thread happens with interrupts off, like every other switch
+  act_itr();
+  fn(arg);
+  exit(0);
+}
+
+/**
+ * Kernel threads share the kernel directory, so switching between them never reloads CR3 (switch_to skips it)
+ * Each one gets a stack from the kernel heap, which is mapped the same in every directory
+ * The stack starts out as the frame switch_to pops, so the first switch to the thread returns into kthread_start
+ */
+static task_t *kernel_task(void (*fn)(void *arg), void *arg, uint8 priority) {
+  task_t *task = alloc_task(priority);
+  task->cr3 = page_directory_physical(kernel_directory);
+  task->page_directory = kernel_directory;
+
+  // a recycled stack was touched when it was first allocated
+  // a new one is touched now, a kernel thread must not take page faults on its own stack
+  if (stack_cache_count) {
+    task->stack = stack_cache[--stack_cache_count];
+  } else {
+    task->stack = (uint8*) kmalloc(KTHREAD_STACK_SIZE);
+    memset(task->stack, 0, KTHREAD_STACK_SIZE);
+  }
+
+  size_t *esp = (size_t*)(task->stack + KTHREAD_STACK_SIZE);
+  *--esp = (size_t)arg;
+  *--esp = (size_t)fn;
+  *--esp = 0;                     // return address for kthread_start, which never returns
+  *--esp = (size_t)&kthread_start; // switch_to returns here
+  *--esp = 0;                     // ebp
+  *--esp = 0;                     // ebx
+  *--esp = 0;                     // esi
+  *--esp = 0;                     // edi
+  *--esp = 0x2;                   // eflags, kthread_start turns interrupts on
+  task->esp = (size_t)esp;
+
+  return task;
+}
+
+task_t *kthread_create(void (*fn)(void *arg), void *arg) {
+  size_t eflags = irq_save();
+
+  task_t *task = kernel_task(fn, arg, SCHED_DEFAULT_PRIORITY);
+  task->id = next_pid++;
+
+  sched_enqueue(task);
+  // the creator may have been running without a deadline, now it has to share the CPU
+  timer_set_deadline(deadline((task_t*)current_task));
+
+  irq_restore(eflags);
+  return task;
+}
+
+static void idle_thread(void *unused) {
+  idle();
+}
+
+void idle() {
+  ASSERT(!current_task || current_task == idle_task);
+
+  for (;;) {
+    // something became ready while we were zeroing or asleep
+    if (sched_ready()) {
+      switch_task();
+      continue;
+    }
+
+    // spare cycles go to zeroing frames for the page fault path
+    if (zero_pool_refill())
+      continue;
+
+    // check once more with interrupts off, sti only takes effect after the hlt so a wakeup cannot slip in between
+    deact_itr();
+    if (sched_ready())
+      act_itr();
+    else
+      halt_until_interrupt();
+  }
+}
+
+/**
+ * Timer ticks the given task may run before the timer has to interrupt it
+ * 0 if nothing can take over from it: it is the idle task or no other task is ready, only an interrupt can change that
+ */
+static size_t deadline(task_t *task) {
+  if (task == idle_task || !sched_ready())
+    return 0;
+  // a more important task is already waiting, give it the CPU on the next tick
+  if (sched_outranked(task->priority))
+    return 1;
+  return task->timeslice;
 }
 
 /**
@@ -47,16 +212,10 @@ void initialise_tasking() {
 void move_stack(void *new_stack_start, size_t size) {
 
   size_t i;
-  for(i = (size_t)new_stack_start; i >= ((size_t)new_stack_start-size); i -= 0x1000) {
-    // create frames for stack, user mode is sufficient here
-    alloc_frame(get_page(i, 1, current_directory), 0 /* User mode */, 1 /* Is writable */ );
-  }
-  
-  // flush the TLB by writing by reading and writing the page directory address
-  // to partially flush, we could use the invlpg instruction but this is simpler
-  size_t pd_addr;
-  asm volatile("mov %%cr3, %0" : "=r" (pd_addr));
-  asm volatile("mov %0, %%cr3" : : "r" (pd_addr));
+  // create frames for stack, kernel mode so that fork() copies it right away instead of sharing it copy-on-write
+  // (the CPU pushes the page fault frame onto this stack, so it can never be read-only)
+  // the page holding new_stack_start is included, the stack is copied into it below
+  map_range(current_directory, (size_t)new_stack_start - size, size + 0x1000, MAP_WRITABLE);
 
   // get current stack and base pointers to determine offset to apply to new stack
   size_t old_stack_pointer; asm volatile("mov %%esp, %0" : "=r" (old_stack_pointer));
@@ -94,113 +253,321 @@ void switch_task() {
     return;
   }
 
-  // check if it is necessary to switch
-  if (current_task == ready_queue && current_task->next == 0) {
-    monitor_write("only one task found, not going to switch\n");
-    return;
+  // the run queues are shared with the timer interrupt
+  size_t eflags = irq_save();
+
+  // the current task goes to the back of its queue with a fresh timeslice
+  // if it is still the most important ready task it is picked right back, and there is nothing to switch
+  task_t *prev = (task_t*)current_task;
+  if (prev != idle_task) {
+    // a boost only lasts for one timeslice
+    if (!prev->timeslice)
+      task_unboost(prev);
+    prev->timeslice = SCHED_TIMESLICE(prev->priority);
+    sched_enqueue(prev);
   }
 
-  size_t esp, ebp, eip;
-  asm volatile("mov %%esp, %0" : "=r"(esp));
-  asm volatile("mov %%ebp, %0" : "=r"(ebp));
+  schedule(prev);
 
-  eip = read_eip();
+  // the task that switched back to us ran with its own EFLAGS, ours were saved above
+  irq_restore(eflags);
+}
 
-  // after read_eip, we could be in one of two states
-  // 1) we received the current instruction pointer and want to continue switching tasks
-  // 2) we have just switched tasks, and because the saved EIP is essentially
-   // -- the instruction after read_eip(), it will seem as if read_eip has just returned
-  // we add a dummy value to the eax (overwriting the actual return value) below to identify the second scenario
-  if (eip == 0x12345) {
-    // the new task has already been setup and started execution
-    monitor_write("parent task found, return\n");
-    return;
-  } 
-
-  // before switching, save off current register values
-  current_task->eip = eip;
-  current_task->esp = esp;
-  current_task->ebp = ebp;
-
-  // switch
-  current_task = current_task->next;
-
-  // if reached the end, go back to the beginning of the queue
-  if (!current_task) current_task = ready_queue;
-
-  // strictly for readability below
-  eip = current_task->eip;
-  esp = current_task->esp;
-  ebp = current_task->ebp;
-  // update the current directory
-  current_directory = current_task->page_directory;
-
-  // Here we:
-  // * Stop interrupts so we don't get interrupted.
-  // * Temporarily put the new EIP location in ECX.
-  // * Load the stack and base pointers from the new task struct.
-  // * Change page directory to the physical address (physical_address_of_tables_physical) of the new directory.
-  // * Put a dummy value (0x12345) in EAX so that above we can recognise that we've just
-  // switched task.
-  // * Restart interrupts. The STI instruction has a delay - it doesn't take effect until after
-  // the next instruction.
-  // * Jump to the location in ECX (remember we put the new EIP in there).
-  asm volatile("cli");
-  asm volatile("mov %0, %%ecx" : : "r"(eip));
-  asm volatile("mov %0, %%esp" : : "r"(esp));
-  asm volatile("mov %0, %%ebp" : : "r"(ebp));
-  asm volatile("mov %0, %%cr3" : : "r"(current_directory->physical_address_of_tables_physical));
-  asm volatile("mov $0x12345, %eax");
-  asm volatile("sti");
-  asm volatile("jmp *%ecx");
+/**
+ * Interrupts off, prev is either back in its run queue or blocked
+ * Runs the most important ready task, or the idle task if there is none
+ */
+static void schedule(task_t *prev) {
+  // anyone spinning on that lock would wait for us forever
+  ASSERT(!prev->spinlocks_held);
+  need_resched = 0;
+
+  task_t *next = sched_pick_next();
+  if (!next)
+    next = idle_task;
+
+  // in tickless mode the timer only interrupts next if something can preempt it
+  timer_set_deadline(deadline(next));
+
+  if (next != prev) {
+    current_task = next;
+    current_directory = next->page_directory;
+    // only arms a #NM trap, the FPU registers themselves are not touched here
+    fpu_switch(next);
+
+    // saves our registers and EFLAGS on this stack and continues next where it stopped
+    // returns once another task switches back to us
+    switch_to(prev, next);
+  }
+}
+
+void task_block() {
+  ASSERT(current_task != idle_task);
+  task_t *prev = (task_t*)current_task;
+  prev->state = TASK_BLOCKED;
+  task_unboost(prev);
+  schedule(prev);
+}
+
+void task_wake(task_t *task) {
+  size_t eflags = irq_save();
+
+  if (task->state == TASK_BLOCKED) {
+    task->state = TASK_READY;
+    task->timeslice = SCHED_TIMESLICE(task->priority);
+    sched_enqueue(task);
+    // the running task may have to make way, or at least share the CPU now
+    if (task->priority < current_task->priority)
+      need_resched = 1;
+    timer_set_deadline(deadline((task_t*)current_task));
+  }
+
+  irq_restore(eflags);
+}
+
+/**
+ * Called by fork_task in process.s with the child's switch_to frame on the stack
+ * Cloning the address space copies the stack, and that frame with it, so the child starts out returning from fork_task
+ */
+void fork_address_space(task_t *child) {
+  child->page_directory = clone_directory(current_directory);
+  child->cr3 = page_directory_physical(child->page_directory);
 }
 
 int fork() {
-  // do not want to get interrupted while modifying kernel structures
-  deact_itr();
+  // no other task may touch the frame allocator or the paging structures while the address space is cloned
+  // interrupts stay on until clone_directory opens its tlb batch, the rest of the fork does not need them off
+  preempt_disable();
 
   // need to reference the parent task later
   task_t *parent_task = (task_t*)current_task;
-
-  page_directory_t *directory = clone_directory(current_directory);
+  // a kernel thread's stack is on the kernel heap, which every directory shares, so the child would not get its own copy
+  ASSERT(!parent_task->stack);
 
   // Create a new task/process
-  task_t *new_task = (task_t*)kmalloc(sizeof(task_t));
+  // the child inherits the parent's priority, its stack is the clone of the parent's at the same address in its own directory
+  task_t *new_task = alloc_task(parent_task->base_priority);
   new_task->id = next_pid++;
-  new_task->esp = new_task->ebp = 0;
-  new_task->eip = 0;
-  new_task->page_directory = directory;
-  new_task->next = 0;
-
-  // add to the end of the task queue
-  task_t *tmp_task = (task_t*)ready_queue;
-  while (tmp_task->next)
-      tmp_task = tmp_task->next;
-  tmp_task->next = new_task;
-
-  // defined in process.s, quickly 
-  // need to tell the task where to start executing which can be found via the current instruction
-  size_t eip = read_eip();
-
-  // at this point we could be either the parent or child task and need to check
-  if (current_task == parent_task) {
-
-    // only setup esp, ebp, and eip for child if we are the parent
-    size_t esp; asm volatile("mov %%esp, %0" : "=r"(esp));
-    size_t ebp; asm volatile("mov %%ebp, %0" : "=r"(ebp));
-    new_task->esp = esp;
-    new_task->ebp = ebp;
-    new_task->eip = eip;
-
-    // all done modifying so interrupts can be reenabled
-    act_itr();
-
-    // parent returns id of newly created child
-    return new_task->id;
-  } else {
+  fpu_fork(parent_task, new_task);
+  // the child resumes inside this section as well and leaves it with its own preempt_enable below
+  new_task->preempt_count = parent_task->preempt_count;
+
+  // returns twice: 1 in the parent right away, 0 in the child once switch_to first runs it
+  if (fork_task(new_task) == 0) {
+    preempt_enable();
     // child returns 0 to inform caller which process is executing
     return 0;
   }
+
+  // the run queues and the children lists are shared with interrupt handlers and exit()
+  size_t eflags = irq_save();
+
+  // wait() finds the child through this list, and exit() orphans it if the parent goes first
+  new_task->parent = parent_task;
+  new_task->next_sibling = parent_task->first_child;
+  if (parent_task->first_child)
+    parent_task->first_child->prev_sibling = new_task;
+  parent_task->first_child = new_task;
+
+  // only ready once its address space and stack exist, O(1) no matter how many tasks there are
+  sched_enqueue(new_task);
+  // the parent may have been running without a deadline, now it has to share the CPU
+  timer_set_deadline(deadline(parent_task));
+
+  // all done modifying so interrupts can be reenabled (if they were enabled before)
+  irq_restore(eflags);
+  preempt_enable();
+
+  // parent returns id of newly created child
+  return new_task->id;
+}
+
+// takes a child off its parent's list of children
+static void unlink_child(task_t *child) {
+  if (child->prev_sibling)
+    child->prev_sibling->next_sibling = child->next_sibling;
+  else
+    child->parent->first_child = child->next_sibling;
+  if (child->next_sibling)
+    child->next_sibling->prev_sibling = child->prev_sibling;
+  child->parent = 0;
+  child->next_sibling = child->prev_sibling = 0;
+}
+
+void exit(int code) {
+  // never turned back on by this task, it does not run again
+  deact_itr();
+
+  task_t *task = (task_t*)current_task;
+  ASSERT(task != idle_task);
+  task->exit_code = code;
+
+  // the children carry on as orphans, nobody will wait() for them so the reaper frees them completely once they exit
+  // the ones that are already zombies only have their task_t left
+  task_t *child = task->first_child;
+  while (child) {
+    task_t *next = child->next_sibling;
+    child->parent = 0;
+    child->next_sibling = child->prev_sibling = 0;
+    if (child->state == TASK_ZOMBIE)
+      kmem_cache_free(task_cache, child);
+    child = next;
+  }
+  task->first_child = 0;
+
+  // we are still running on the stack and in the address space the reaper frees, it only gets to them after this switch
+  task->state = TASK_DEAD;
+  task->next = dead_tasks;
+  dead_tasks = task;
+  wake_up(&reaper_queue);
+
+  schedule(task);
+  PANIC("exited task was scheduled again");
+}
+
+int wait(int *exit_code) {
+  size_t eflags = irq_save();
+
+  task_t *task = (task_t*)current_task;
+  int pid = -1;
+
+  while (task->first_child) {
+    task_t *child = task->first_child;
+    while (child && child->state != TASK_ZOMBIE)
+      child = child->next_sibling;
+
+    if (child) {
+      pid = child->id;
+      if (exit_code)
+        *exit_code = child->exit_code;
+      unlink_child(child);
+      kmem_cache_free(task_cache, child);
+      break;
+    }
+
+    // woken whenever the reaper turns some task into a zombie, it may not be ours
+    sleep_on(&child_exit_queue);
+  }
+
+  irq_restore(eflags);
+  return pid;
+}
+
+/**
+ * Preemption off, the task has exited and is not running
+ * Gives back everything but the task_t: its address space (user frames, page tables and the directory all go back to
+ * the frame allocator and pt_pool) or its kernel thread stack, and its FPU save area
+ */
+static void release_task(task_t *task) {
+  fpu_release(task);
+
+  if (task->stack) {
+    if (stack_cache_count < KSTACK_CACHE_SIZE)
+      stack_cache[stack_cache_count++] = task->stack;
+    else
+      kfree(task->stack);
+    task->stack = 0;
+  } else if (task->page_directory != kernel_directory) {
+    // the root task runs in the kernel directory itself
+    free_directory(task->page_directory);
+  }
+  task->page_directory = 0;
+}
+
+/**
+ * Kernel thread that frees exited tasks, they cannot free the stack and address space they are running on themselves
+ * A task whose parent may still wait() for it becomes a zombie, only its task_t and exit code remain until wait() frees it
+ */
+static void reaper(void *unused) {
+  for (;;) {
+    size_t eflags = irq_save();
+    task_t *task = dead_tasks;
+    if (!task) {
+      sleep_on(&reaper_queue);
+      irq_restore(eflags);
+      continue;
+    }
+    dead_tasks = task->next;
+    task->next = 0;
+    irq_restore(eflags);
+
+    // no other task may touch the frame allocator or the paging structures meanwhile, like in fork
+    preempt_disable();
+    release_task(task);
+    preempt_enable();
+
+    eflags = irq_save();
+    if (task->parent) {
+      task->state = TASK_ZOMBIE;
+      wake_up_all(&child_exit_queue);
+    } else {
+      kmem_cache_free(task_cache, task);
+    }
+    irq_restore(eflags);
+  }
+}
+
+void task_tick(size_t ticks) {
+  if (!current_task)
+    return;
+
+  // the switch itself happens on the way out of the interrupt, or once the task leaves its preempt_disable section
+  if (sched_tick((task_t*)current_task, ticks))
+    need_resched = 1;
+  else
+    timer_set_deadline(deadline((task_t*)current_task));
+}
+
+void set_priority(uint8 priority) {
+  ASSERT(priority < SCHED_PRIORITIES);
+  task_t *task = (task_t*)current_task;
+  task->base_priority = priority;
+  task->timeslice = SCHED_TIMESLICE(priority);
+
+  // a mutex waiter may still be lending us a more important one
+  size_t eflags = irq_save();
+  uint8 inherited = mutex_inherited_priority(task);
+  task_set_priority(task, inherited < priority ? inherited : priority);
+  irq_restore(eflags);
+}
+
+void task_set_priority(task_t *task, uint8 priority) {
+  ASSERT(priority < SCHED_PRIORITIES);
+  size_t eflags = irq_save();
+
+  // every ready task but the running one is in the run queue of its priority
+  int queued = task != current_task && task->state == TASK_READY;
+  if (queued)
+    sched_dequeue(task);
+  task->priority = priority;
+  if (queued)
+    sched_enqueue(task);
+
+  if (sched_outranked(current_task->priority))
+    need_resched = 1;
+
+  irq_restore(eflags);
+}
+
+void task_boost(task_t *task, uint8 priority) {
+  size_t eflags = irq_save();
+  if (priority < task->priority) {
+    task->boosted = 1;
+    task_set_priority(task, priority);
+  }
+  irq_restore(eflags);
+}
+
+/**
+ * Interrupts off, the task is running (so not in a run queue)
+ * Gives up a priority lent by task_boost, keeping whatever a mutex waiter still lends it
+ */
+static void task_unboost(task_t *task) {
+  if (!task->boosted)
+    return;
+  task->boosted = 0;
+  uint8 inherited = mutex_inherited_priority(task);
+  task->priority = inherited < task->base_priority ? inherited : task->base_priority;
 }
 
 int getpid() {
@@ -8,23 +8,118 @@
  * A task/process stores information needed to properly stop/start the process in case of interrupts and/or context switching
  */
 
+// running or in a run queue
+#define TASK_READY   0
+// in a wait queue (or sleeping), only task_wake puts it back in a run queue
+#define TASK_BLOCKED 1
+// called exit(), waiting for the reaper to free its stack or address space
+#define TASK_DEAD    2
+// reaped, only the task_t remains until its parent collects the exit code with wait()
+#define TASK_ZOMBIE  3
+
+// kernel stack of a kernel thread
+#define KTHREAD_STACK_SIZE 0x2000
+
+struct wait_queue;
+struct mutex;
+
+/**
+ * switch_to in process.s depends on esp and cr3 being the first two members
+ */
 typedef struct task {
+    size_t esp; // kernel stack pointer while the task is switched out, the rest of its registers are saved on that stack
+    size_t cr3; // physical address of page_directory, loaded by switch_to
     int id; // self explanatory, but unique identifies the process   
-    size_t esp, ebp; // stack and base pointers      
-    size_t eip; // instruction pointer           
     page_directory_t *page_directory; // page directory
-    struct task *next; // next task in linked list    
+    uint8 *fpu_state; // fxsave area, 0 until the task first uses the FPU (see fpu.h)
+    uint8 *stack; // bottom of a kernel thread's stack (KTHREAD_STACK_SIZE bytes on the kernel heap), 0 for processes
+    uint8 priority; // 0 is the most important, see sched.h, may be raised above base_priority by a mutex waiter
+    uint8 base_priority; // priority set for the task itself, without anything inherited (see sync.h)
+    size_t timeslice; // timer ticks left before the task has to give up the CPU
+    uint8 state; // TASK_READY, TASK_BLOCKED, TASK_DEAD or TASK_ZOMBIE
+    struct wait_queue *wait_queue; // wait queue the task is blocked on, 0 if none
+    struct task *next; // next task in its run queue or wait queue
+    struct task *prev; // previous task in its run queue or wait queue
+    struct task *parent; // task that forked this one, 0 for kernel threads and orphans
+    struct task *first_child; // children that have not been collected by wait() yet
+    struct task *next_sibling; // next child of the same parent
+    struct task *prev_sibling; // previous child of the same parent
+    int exit_code; // passed to exit(), returned by wait()
+    int preempt_count; // preempt_disable nesting depth, the task is only preempted while it is 0 (see preempt.h)
+    int spinlocks_held; // spinlocks the task holds, it must not block or switch away while this is not 0 (see sync.h)
+    uint8 boosted; // running at a priority lent by task_boost, until it uses up its timeslice or blocks again
+    struct mutex *waiting_for; // mutex the task is blocked on, followed for priority inheritance
+    struct mutex *held_mutexes; // mutexes the task holds, linked through next_held
 } task_t;
 
 //
 void initialise_tasking();
 
-// when the timer interrupt fires, it calls this method to change the running process
+// gives the CPU to the most important ready task, the current task goes to the back of its run queue
+// if nothing more important is ready (or nothing else at all) the current task keeps running
 void switch_task();
 
-// forks/clones the existing process to a new address space
+/**
+ * Defined in process.s
+ * Saves the callee-saved registers and EFLAGS on the current stack, stores the stack pointer in prev->esp,
+ * then loads next->esp and pops next's registers and EFLAGS. CR3 is only reloaded if next->cr3 differs.
+ * Returns when some task switches back to prev.
+ */
+extern void switch_to(task_t *prev, task_t *next);
+
+/**
+ * The current task gives up the CPU without going back to a run queue, it runs again once task_wake is called for it
+ * Interrupts must be off, so that the wakeup cannot happen between the caller deciding to block and blocking
+ */
+void task_block();
+
+// puts a blocked task back in its run queue with a fresh timeslice, does nothing if it is not blocked
+void task_wake(task_t *task);
+
+// called by the timer interrupt with the ticks since the last one (1 unless the timer is tickless)
+// asks for a switch (need_resched) once the current timeslice runs out or a more important task is ready
+void task_tick(size_t ticks);
+
+/**
+ * The idle loop, run by the idle task whenever no task is ready
+ * Refills the zero page pool, then halts until an interrupt makes a task ready
+ * kernel_main ends in it as well when tasking is off, it must never run in a task that can be scheduled
+ * (it would keep switching to itself instead of halting)
+ */
+void idle() __attribute__((noreturn));
+
+// changes the priority of the running task, 0 is the most important
+void set_priority(uint8 priority);
+
+// changes the effective priority of any task, moving it to the right run queue if it is in one (used by mutexes)
+void task_set_priority(task_t *task, uint8 priority);
+
+/**
+ * Lends a more important priority to a task, e.g. one that is about to be woken by keyboard input
+ * The task keeps it until it uses up a timeslice or blocks again, then it drops back to its own (or inherited) priority
+ */
+void task_boost(task_t *task, uint8 priority);
+
+/**
+ * Starts fn(arg) in a new kernel thread at the default priority, returns its task
+ * The thread shares kernel_directory and only gets its own stack, there is no address space to copy.
+ * It exits when fn returns.
+ */
+task_t *kthread_create(void (*fn)(void *arg), void *arg);
+
+// forks/clones the existing process to a new address space, kernel threads cannot fork
 int fork();
 
+/**
+ * Ends the current task, does not return
+ * Its stack, address space and FPU state are freed by the reaper thread. Unless it was orphaned the task_t stays around
+ * (a zombie) until the parent collects the exit code with wait(). Its children are orphaned and freed once they exit.
+ */
+void exit(int code);
+
+// blocks until a child has exited, stores its exit code (if exit_code is not 0) and returns its pid, -1 without children
+int wait(int *exit_code);
+
 // moves a process' stack the new desired location
 void move_stack(void *new_stack_start, size_t size);
 
@@ -0,0 +1,152 @@
+#include "wait.h"
+#include "task.h"
+#include "sched.h"
+#include "../drivers/timer/ktimer.h"
+#include "../tools.h"
+
+extern volatile task_t *current_task;
+
+void wait_queue_init(wait_queue_t *queue) {
+    queue->head = queue->tail = 0;
+}
+
+static void queue_append(wait_queue_t *queue, task_t *task) {
+    task->next = 0;
+    task->prev = queue->tail;
+    if (queue->tail)
+        queue->tail->next = task;
+    else
+        queue->head = task;
+    queue->tail = task;
+}
+
+static void queue_remove(wait_queue_t *queue, task_t *task) {
+    if (task->prev)
+        task->prev->next = task->next;
+    else
+        queue->head = task->next;
+    if (task->next)
+        task->next->prev = task->prev;
+    else
+        queue->tail = task->prev;
+    task->next = task->prev = 0;
+}
+
+// interrupts off, takes the task off its wait queue (if it is on one) and makes it ready
+static void wake_task(task_t *task) {
+    if (task->wait_queue) {
+        queue_remove(task->wait_queue, task);
+        task->wait_queue = 0;
+    }
+    task_wake(task);
+}
+
+// a task in sleep_on_timeout, on its stack
+typedef struct sleeper {
+    task_t *task;
+    int timed_out; // set only if the timeout is what woke the task
+} sleeper_t;
+
+// ktimer callback, the task slept long enough
+static void timeout_expired(void *arg) {
+    sleeper_t *sleeper = (sleeper_t*)arg;
+    // a wake_up got there first, the task is ready but has not run yet and keeps that wakeup
+    if (sleeper->task->state != TASK_BLOCKED)
+        return;
+    sleeper->timed_out = 1;
+    wake_task(sleeper->task);
+}
+
+void sleep_on(wait_queue_t *queue) {
+    sleep_on_timeout(queue, 0);
+}
+
+int sleep_on_timeout(wait_queue_t *queue, size_t ticks) {
+    // a wakeup must not slip in between joining the queue and blocking
+    size_t eflags = irq_save();
+
+    task_t *task = (task_t*)current_task;
+    if (queue) {
+        queue_append(queue, task);
+        task->wait_queue = queue;
+    }
+
+    // both live on our stack, the timer is cancelled before this returns
+    sleeper_t sleeper = { task, 0 };
+    ktimer_t timeout;
+    if (ticks) {
+        ktimer_init(&timeout, &timeout_expired, &sleeper);
+        ktimer_add(&timeout, ticks);
+    }
+
+    task_block();
+
+    // back on the CPU: woken by a wake_up unless the timer did it, whether or not the timer fired since
+    if (ticks)
+        ktimer_cancel(&timeout);
+
+    irq_restore(eflags);
+    return !sleeper.timed_out;
+}
+
+void sleep(size_t ticks) {
+    // nothing would ever wake a sleep without a timeout, give up the CPU once instead
+    if (!ticks) {
+        switch_task();
+        return;
+    }
+    sleep_on_timeout(0, ticks);
+}
+
+int wake_up(wait_queue_t *queue) {
+    size_t eflags = irq_save();
+
+    task_t *task = queue->head;
+    if (task)
+        wake_task(task);
+
+    irq_restore(eflags);
+    return task != 0;
+}
+
+int wake_up_interactive(wait_queue_t *queue) {
+    size_t eflags = irq_save();
+
+    task_t *task = queue->head;
+    if (task) {
+        // boosted while still blocked, so task_wake queues it at the new priority and preempts anything less important
+        task_boost(task, SCHED_INTERACTIVE_PRIORITY);
+        wake_task(task);
+    }
+
+    irq_restore(eflags);
+    return task != 0;
+}
+
+int wake_up_priority(wait_queue_t *queue) {
+    size_t eflags = irq_save();
+
+    task_t *best = queue->head;
+    task_t *task;
+    for (task = queue->head; task; task = task->next)
+        if (task->priority < best->priority)
+            best = task;
+    if (best)
+        wake_task(best);
+
+    irq_restore(eflags);
+    return best != 0;
+}
+
+size_t wake_up_all(wait_queue_t *queue) {
+    size_t eflags = irq_save();
+
+    size_t woken = 0;
+    while (queue->head) {
+        wake_task(queue->head);
+        woken++;
+    }
+
+    irq_restore(eflags);
+    return woken;
+}
@@ -0,0 +1,43 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "../tools.h"
+#include "task.h"
+
+/**
+ * Wait queues let a task block until an event or a timeout, without polling
+ * A blocked task is linked into the wait queue through the same next/prev members that link it into a run queue
+ * (it is never in both), so it costs nothing per tick. Waking is O(1) per task, timeouts use a kernel timer (ktimer.h).
+ *
+ * Waiters are woken in the order they went to sleep.
+ */
+
+typedef struct wait_queue {
+    task_t *head;
+    task_t *tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t *queue);
+
+// blocks the current task until wake_up/wake_up_all picks it
+void sleep_on(wait_queue_t *queue);
+
+// as sleep_on, but gives up after ticks timer ticks (0 waits forever), returns 1 if woken and 0 on timeout
+int sleep_on_timeout(wait_queue_t *queue, size_t ticks);
+
+// blocks the current task for ticks timer ticks, 0 only lets other ready tasks run first (see switch_task)
+void sleep(size_t ticks);
+
+// wakes the task that has waited longest, returns 1 if there was one
+int wake_up(wait_queue_t *queue);
+
+// as wake_up, and the woken task runs at SCHED_INTERACTIVE_PRIORITY for a timeslice (see task_boost), used for input
+int wake_up_interactive(wait_queue_t *queue);
+
+// wakes the most important waiting task (the one that has waited longest among equals), returns 1 if there was one
+int wake_up_priority(wait_queue_t *queue);
+
+// wakes every waiting task, returns how many there were
+size_t wake_up_all(wait_queue_t *queue);
+
+#endif
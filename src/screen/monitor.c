@@ -60,8 +60,14 @@ static void scroll() {
     }
 }
 
+/**
+ * The keyboard interrupt echoes keys while tasks print, so the cursor, the colour and the scroll state are only
+ * touched with interrupts off. monitor_write keeps a whole string together.
+ */
 void monitor_put(char c) {
 
+    size_t eflags = irq_save();
+
     uint8  attribute_byte = get_attribute_byte();
     uint16 attribute = attribute_byte << 8;
     uint16 blank = 0x20 | (attribute_byte << 8);
@@ -100,12 +106,15 @@ void monitor_put(char c) {
     scroll();
     
     move_cursor();
+
+    irq_restore(eflags);
 }
 
 /**
  * clears the entire screen
  */ 
 void monitor_clear() {
+   size_t eflags = irq_save();
    uint16 blank = 0x20 | (get_attribute_byte() << 8); // write space
 
    int i;
@@ -116,27 +125,33 @@ void monitor_clear() {
    cursor_x = 0;
    cursor_y = 0;
    move_cursor();
+   irq_restore(eflags);
 }
 
 /**
  * Wrapper to write an entire string
  */ 
 void monitor_write(char *c) {
+   size_t eflags = irq_save();
    int i = 0;
 
    while (c[i]) {
        monitor_put(c[i++]);
    }
+   irq_restore(eflags);
 }
 
 void monitor_write_color(char *c, uint8 color) {
 
+    // a key echoed meanwhile would come out in this colour
+    size_t eflags = irq_save();
     uint8 temp = foreground_color;
     foreground_color = color;
 
     monitor_write(c);
 
     foreground_color = temp;
+    irq_restore(eflags);
 }
 
 void monitor_write_sys(char * c) {
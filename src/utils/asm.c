@@ -1,5 +1,6 @@
 #include "dttp.h"
 #include "asm.h"
+#include "irq_latency.h"
 
 
 void outb(uint16 port, uint8 value) {
@@ -18,10 +19,58 @@ uint16 inw(uint16 port) {
    return ret;
 }
 
+void cpuid(uint32 leaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx) {
+   asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
+uint64 rdtsc() {
+   uint64 ret;
+   asm volatile("rdtsc" : "=A" (ret));
+   return ret;
+}
+
+void halt() {
+   asm volatile("hlt");
+}
+
+void halt_until_interrupt() {
+   if (irq_latency_tracking)
+      irq_latency_end();
+   asm volatile("sti; hlt");
+}
+
+size_t irq_save() {
+   size_t flags;
+   asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+   // only the outermost section opens a window
+   if (irq_latency_tracking && (flags & EFLAGS_IF))
+      irq_latency_begin(__builtin_return_address(0));
+   return flags;
+}
+
+void irq_restore(size_t flags) {
+   if (irq_latency_tracking && (flags & EFLAGS_IF))
+      irq_latency_end();
+   asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+int irqs_enabled() {
+   size_t flags;
+   asm volatile("pushf; pop %0" : "=r"(flags));
+   return (flags & EFLAGS_IF) != 0;
+}
+
 void act_itr(){
+	if (irq_latency_tracking)
+		irq_latency_end();
 	asm volatile("sti");
 }
 
 void deact_itr(){
+	if (irq_latency_tracking && irqs_enabled()) {
+		asm volatile("cli");
+		irq_latency_begin(__builtin_return_address(0));
+		return;
+	}
 	asm volatile("cli");
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define ASM
 
 #include "dttp.h"
+#include "stddef.h"
 
 // Writes a byte to the specified port
 void outb(uint16 port, uint8 value);
@@ -12,6 +13,34 @@ uint8 inb(uint16 port);
 // Reads a word (2 bytes) from the specified port
 uint16 inw(uint16 port);
 
+// Runs the cpuid instruction for the given leaf
+void cpuid(uint32 leaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx);
+
+// Reads the time stamp counter (CPU cycles since reset)
+uint64 rdtsc();
+
+// Stops the CPU until the next interrupt arrives
+void halt();
+
+// Enables interrupts and halts, an interrupt arriving in between still wakes the CPU since sti only takes effect after the next instruction
+void halt_until_interrupt();
+
+// interrupt enable flag in EFLAGS
+#define EFLAGS_IF 0x200
+
+/**
+ * Disables interrupts and returns the EFLAGS they were disabled from, to be handed to irq_restore
+ * Sections nest: an inner irq_restore leaves interrupts off because they were already off at its irq_save
+ */
+size_t irq_save();
+
+// Restores the EFLAGS returned by the matching irq_save, interrupts are only turned back on if they were on before
+void irq_restore(size_t flags);
+
+// Returns 1 if interrupts are enabled
+int irqs_enabled();
+
+// bare sti/cli, for code that knows interrupts are off (or on) and does not nest, use irq_save/irq_restore otherwise
 void act_itr();
 void deact_itr();
 
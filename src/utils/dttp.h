@@ -1,6 +1,7 @@
 #ifndef DTTP
 #define DTTP
 
+typedef unsigned long long uint64;
 typedef unsigned int   uint32;
 typedef          int   int32;
 typedef unsigned short uint16;
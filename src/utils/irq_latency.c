@@ -0,0 +1,79 @@
+#include "irq_latency.h"
+#include "asm.h"
+#include "../screen/monitor.h"
+
+typedef struct irq_window {
+    void *site;     // return address of the irq_save call that opened the window
+    uint32 cycles;  // longest window seen for that site
+    uint32 count;   // windows seen for that site
+} irq_window_t;
+
+uint8 irq_latency_tracking = 0;
+
+static irq_window_t worst[IRQ_LATENCY_SITES];
+
+// the window currently open, if any
+static uint8 open = 0;
+static uint64 start;
+static void *open_site;
+
+void irq_latency_enable() {
+    irq_latency_tracking = 1;
+}
+
+void irq_latency_begin(void *site) {
+    // a window still open means interrupts came back on somewhere without closing it, charge it up to now
+    if (open)
+        irq_latency_end();
+
+    open = 1;
+    open_site = site;
+    start = rdtsc();
+}
+
+void irq_latency_end() {
+    // closed already, or it was never opened
+    if (!open)
+        return;
+    open = 0;
+
+    uint32 cycles = (uint32)(rdtsc() - start);
+
+    // the site's own entry, otherwise the entry with the shortest window is replaced if this one is longer
+    size_t i, shortest = 0;
+    for (i = 0; i < IRQ_LATENCY_SITES; i++) {
+        if (worst[i].site == open_site)
+            break;
+        if (worst[i].cycles < worst[shortest].cycles)
+            shortest = i;
+    }
+
+    if (i == IRQ_LATENCY_SITES) {
+        if (cycles <= worst[shortest].cycles)
+            return;
+        i = shortest;
+        worst[i].site = open_site;
+        worst[i].cycles = 0;
+        worst[i].count = 0;
+    }
+
+    worst[i].count++;
+    if (cycles > worst[i].cycles)
+        worst[i].cycles = cycles;
+}
+
+void irq_latency_print_stats() {
+    monitor_write("longest interrupts-off windows (cycles):\n");
+    size_t i;
+    for (i = 0; i < IRQ_LATENCY_SITES; i++) {
+        if (!worst[i].site)
+            continue;
+        monitor_write("  ");
+        monitor_write_hex((size_t)worst[i].site);
+        monitor_write(": ");
+        monitor_write_dec(worst[i].cycles);
+        monitor_write(" max over ");
+        monitor_write_dec(worst[i].count);
+        monitor_write("\n");
+    }
+}
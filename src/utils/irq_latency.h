@@ -0,0 +1,33 @@
+#ifndef IRQ_LATENCY_H
+#define IRQ_LATENCY_H
+
+#include "dttp.h"
+
+/**
+ * Debug mode that measures how long interrupts stay off
+ * A window opens when irq_save (or deact_itr) turns interrupts off and closes when irq_restore (or act_itr) turns them
+ * back on, a task switch in between is part of the window. A switch to a task that was preempted on its way out of an
+ * interrupt closes the window at that task's iret (irq_handler ends it). It is timed with rdtsc and charged to the code that called
+ * irq_save, the longest window of the IRQ_LATENCY_SITES worst call sites is kept.
+ * Time spent in interrupt handlers themselves (interrupt gates turn interrupts off without irq_save) is not counted.
+ *
+ * Off by default, the irqtrace boot option turns it on.
+ */
+
+#define IRQ_LATENCY_SITES 8
+
+// set while windows are being measured, checked by irq_save/irq_restore before calling into this file
+extern uint8 irq_latency_tracking;
+
+void irq_latency_enable();
+
+// interrupts were just turned off by the code at site
+void irq_latency_begin(void *site);
+
+// interrupts are about to be turned back on
+void irq_latency_end();
+
+// prints the worst call sites and their longest window in cycles
+void irq_latency_print_stats();
+
+#endif
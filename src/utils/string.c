@@ -41,4 +41,16 @@ int strlen(char *src) {
     while (*src++)
         i++;
     return i;
+}
+
+char *strstr(char *haystack, char *needle) {
+    int len = strlen(needle);
+    for (; *haystack; haystack++) {
+        int i = 0;
+        while (i < len && haystack[i] == needle[i])
+            i++;
+        if (i == len)
+            return haystack;
+    }
+    return len == 0 ? haystack : 0;
 }
\ No newline at end of file
@@ -9,4 +9,7 @@ char *strcpy(char *dest, const char *src);
 char *strcat(char *dest, const char *src);
 int strlen(char *src);
 
+// returns the first occurrence of needle in haystack, or 0 if there is none
+char *strstr(char *haystack, char *needle);
+
 #endif
\ No newline at end of file